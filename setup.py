@@ -1,34 +1,81 @@
-from distutils.core import setup, Extension
-import os, numpy
+from setuptools import setup, Extension, Command
+import os, sys, numpy
 
 """ Setup script for the sla python extension"""
 
+class bench(Command):
+    """Builds the extension in place then runs trm.sla.bench"""
+
+    description  = 'build in place and run the trm.sla benchmarks'
+    user_options = [('max=',   None, 'log10 of the largest array size [6]'),
+                    ('save=',  None, 'file to save reference results to'),
+                    ('check=', None, 'file of reference results to check against')]
+
+    def initialize_options(self):
+        self.max   = None
+        self.save  = None
+        self.check = None
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        build_ext = self.reinitialize_command('build_ext')
+        build_ext.inplace = 1
+        self.run_command('build_ext')
+
+        argv = []
+        for name in ('max', 'save', 'check'):
+            if getattr(self, name) is not None:
+                argv += ['--' + name, str(getattr(self, name))]
+
+        sys.path.insert(0, os.getcwd())
+        from trm.sla import bench
+        if bench.main(argv):
+            sys.exit(1)
+
 library_dirs = []
 include_dirs = []
 
 # need to direct to where includes and  libraries are
-if os.environ.has_key('TRM_SOFTWARE'):
+if 'TRM_SOFTWARE' in os.environ:
     library_dirs.append(os.path.join(os.environ['TRM_SOFTWARE'], 'lib'))
     include_dirs.append(os.path.join(os.environ['TRM_SOFTWARE'], 'include'))
 else:
-    print >>sys.stderr, "Environment variable TRM_SOFTWARE pointing to location of shareable libraries and includes not defined!"
+    print("Environment variable TRM_SOFTWARE pointing to location of shareable libraries and includes not defined!",
+          file=sys.stderr)
 
 include_dirs.append(numpy.get_include())
 
+define_macros = [('MAJOR_VERSION', '0'), ('MINOR_VERSION', '1')]
+
+# compile in the timing counters reported by trm.sla.stats
+if 'TRM_SLA_PROFILE' in os.environ:
+    define_macros.append(('SLA_PROFILE', '1'))
+
 sla = Extension('trm.sla._sla',
-                define_macros   = [('MAJOR_VERSION', '0'),
-                                   ('MINOR_VERSION', '1')],
+                define_macros   = define_macros,
                 undef_macros    = ['USE_NUMARRAY'],
                 include_dirs    = include_dirs,
                 library_dirs    = library_dirs,
                 runtime_library_dirs = library_dirs,
                 libraries       = ['csla'],
+                # -fopenmp-simd enables the '#pragma omp simd' loops without
+                # OpenMP threads; -fno-math-errno lets sqrt vectorise;
+                # -ffp-contract=off keeps the vectorised and scalar results
+                # identical
+                extra_compile_args = ['-std=c++11', '-pthread', '-fopenmp-simd',
+                                      '-fno-math-errno', '-ffp-contract=off'],
+                extra_link_args = ['-pthread'],
                 sources         = [os.path.join('trm', 'sla', 'sla.cc')])
 
 setup(name='trm.sla',
       version='0.1',
       packages = ['trm', 'trm.sla'],
       ext_modules=[sla],
+      python_requires = '>=3.9',
+      install_requires = ['numpy>=1.19'],
+      cmdclass = {'bench' : bench},
 
       author='Tom Marsh',
       author_email='t.r.marsh@warwick.ac.uk',
@@ -10,26 +10,57 @@ Functions
 =========
 
 amass       -- calculates observational parameters given position and time
+amass_batch -- amass for many targets at once
+build_cache -- writes the mode='interp' tables to a file for fast loading
 cldj        -- compute MJD from a date
 djcl        -- compute date from an MJD
 dtt         -- gives TT-UTC
 eqgal       -- conversion from Equatorial (J2000) to galactic coordinates
 fk425       -- convert from FK4 B1950 to FK5 J2000 coordinates.
 galeq       -- convert from galactic to FK5
+load_cache  -- maps a file written by build_cache (or set TRM_SLA_CACHE)
+night_table -- Sun and target rise, set and twilight times for many nights
+refro_table -- the slaRefro lookup table used by sun with rtable=True
+run_batch   -- many independent scalar utc2tdb, amass and sun calls at once
+reset_stats -- zeroes the counters returned by stats
+stats       -- time spent per stage of utc2tdb, amass and sun (profiling builds only)
 sun         -- computes Sun's position on the sky.
 sun_at_elev -- works out when the Sun crosses a given elevation
+sun_root    -- sun_at_elev for many nights and sites at once
 utc2tdb     -- compute tdb, heliocentric corrections etc
+utc2tdb_batch -- utc2tdb for many targets at once
+utc2tdb_stream -- utc2tdb chunk by chunk for very long (e.g. memory-mapped) arrays
+utc2tdb_file -- utc2tdb from and to memory-mapped raw or FITS binary table files
+visibility_windows -- when targets are below an airmass limit with the Sun down
+
+Ufuncs
+======
+
+NumPy ufunc versions of some of the above, which broadcast all their
+arguments, accept N-D arrays and support out= and where= etc. Invalid
+inputs give NaN rather than raising exceptions.
+
+ufunc_amass, ufunc_eqgal, ufunc_galeq, ufunc_sun, ufunc_utc2tdb
+
+Classes
+=======
+
+Batcher     -- collects calls from many threads for run_batch, returning futures
+Observatory -- an observing site, with methods utc2tdb, amass and sun
+Target      -- a target position for use with Observatory
 
 """
-import sys
-sys.path.append('.')
-from _sla import *
+from ._sla import *
 
-import exceptions
+import os
 import re
+import threading
+import time
+from concurrent.futures import Future
+import numpy as np
 
 # Exception class
-class SlaError(exceptions.Exception):
+class SlaError(Exception):
     """For throwing exceptions from the sla module"""
     def __init__(self, value):
         self.value = value
@@ -59,23 +90,372 @@ def sun_at_elev(longitude, latitude, height, utc1, utc2, elev, wave=0.55, rh=0.2
     rh        -- relative humidity, 0 to 1
     acc       -- accuracy of final answer in days.
 
-    The utc is returned as a decimal MJD
+    The utc is returned as a decimal MJD. This is a wrapper around sun_root
+    which can solve for many nights and sites at once.
     """
 
-    (az1, el1, ref1, ra1, dec1) = sun(utc1,longitude,latitude,height,wave,rh,fast)
-    (az2, el2, ref2, ra2, dec2) = sun(utc2,longitude,latitude,height,wave,rh,fast)
-
-    if (el1 > elev and el2 > elev) or (el1 < elev and el2 < elev):
+    utc = sun_root(utc1,utc2,elev,longitude,latitude,height,wave,rh,acc,fast)
+    if utc != utc:
+        (az1, el1, ref1, ra1, dec1) = sun(utc1,longitude,latitude,height,wave,rh,fast)
+        (az2, el2, ref2, ra2, dec2) = sun(utc2,longitude,latitude,height,wave,rh,fast)
         raise SlaError('Initial times do not bracket the critical elevation, el1, el2: ' 
                        + str(el1) + ', ' + str(el2))
+    return utc
+
+UTC2TDB_OUTPUTS = ('tt', 'tdb', 'btdb', 'hutc', 'htdb', 'vhel', 'vbar')
+
+def utc2tdb_stream(utc, longitude, latitude, height, ra, dec, pmra=0., pmdec=0., epoch=2000., 
+                   parallax=0., rv=0., outputs=('btdb',), chunk=1000000, nthreads=1, mode='exact',
+                   dtype=None):
+    """
+    for start, results in utc2tdb_stream(utc, longitude, latitude, height, ra, dec, pmra=0., pmdec=0.,
+                                         epoch=2000., parallax=0., rv=0., outputs=('btdb',), 
+                                         chunk=1000000, nthreads=1, mode='exact', dtype=None):
+
+    Generator which runs utc2tdb over a 1D array of utcs chunk elements at a time, for
+    time series too long to hold all seven outputs of utc2tdb in memory. utc can be a
+    numpy.memmap (or a column of a memory-mapped FITS table) since each chunk is read
+    in place. Each step yields the index of the first utc of the chunk and a tuple of
+    arrays, one for each name in outputs, chosen from 'tt', 'tdb', 'btdb', 'hutc', 'htdb',
+    'vhel' and 'vbar'; only these are computed. The arrays are re-used from one chunk
+    to the next, so copy or write them out before moving on; the memory used is fixed
+    by chunk and the number of outputs. The other arguments are as for utc2tdb; with
+    dtype=numpy.float32, vhel and vbar come back as float32 while the times stay float64.
+    """
+
+    if isinstance(outputs, str):
+        outputs = (outputs,)
+    for name in outputs:
+        if name not in UTC2TDB_OUTPUTS:
+            raise SlaError('utc2tdb_stream: unrecognised output = ' + str(name))
+
+    if chunk < 1:
+        raise SlaError('utc2tdb_stream: chunk must be at least 1')
+
+    single = dtype is not None and np.dtype(dtype) == np.float32
+    ntot = len(utc)
+    bufs = [np.empty(min(chunk, ntot), np.float32 if single and name in ('vhel', 'vbar') else np.float64)
+            for name in outputs]
+    for start in range(0, ntot, chunk):
+        end  = min(start+chunk, ntot)
+        outs = [buf[:end-start] for buf in bufs]
+        utc2tdb(utc[start:end], longitude, latitude, height, ra, dec, pmra, pmdec, epoch,
+                parallax, rv, nthreads=nthreads, mode=mode, outputs=outputs,
+                dtype=dtype, out=outs)
+        yield start, tuple(outs)
+
+# Bytes per element of FITS binary table column format codes (X, bits, is
+# handled separately) and the numpy types of those that can be read as
+# numbers
+FITS_SIZES  = {'L' : 1, 'X' : 1, 'B' : 1, 'I' : 2, 'J' : 4, 'K' : 8, 'A' : 1, 'E' : 4,
+               'D' : 8, 'C' : 8, 'M' : 16, 'P' : 8, 'Q' : 16}
+FITS_DTYPES = {'B' : 'u1', 'I' : '>i2', 'J' : '>i4', 'K' : '>i8', 'E' : '>f4', 'D' : '>f8'}
+
+def _fits_value(text):
+    """Value of a FITS header card given the text after the '= '."""
+    match = re.match(r"\s*'((?:[^']|'')*)'", text)
+    if match:
+        return match.group(1).replace("''", "'").rstrip()
+    value = text.split('/')[0].strip()
+    if value in ('T', 'F'):
+        return value == 'T'
+    try:
+        return int(value)
+    except ValueError:
+        try:
+            return float(value.replace('D', 'E'))
+        except ValueError:
+            return value
+
+def _fits_table(fname, ext):
+    """
+    offset, nrow, rowlen, columns = _fits_table(fname, ext)
+
+    Locates binary table extension ext (1 for the first) of FITS file fname,
+    reading only the headers. Returns the byte offset of the table in the file,
+    its numbers of rows and bytes per row, and a dictionary of its columns,
+    keyed by upper case name and by number from 1, of (byte offset in row,
+    numpy dtype or None if not numeric, TSCAL, TZERO).
+    """
+    BLOCK = 2880
+    with open(fname, 'rb') as fptr:
+        pos = 0
+        for hdu in range(ext+1):
+            cards, end = {}, False
+            while not end:
+                block = fptr.read(BLOCK)
+                if len(block) < BLOCK:
+                    raise SlaError('utc2tdb_file: ' + fname + ' has no extension ' + str(ext))
+                pos += BLOCK
+                for i in range(0, BLOCK, 80):
+                    card = block[i:i+80].decode('ascii', 'replace')
+                    if card[:8].strip() == 'END':
+                        end = True
+                        break
+                    if card[8:10] == '= ':
+                        cards[card[:8].strip()] = _fits_value(card[10:])
+
+            size = 0
+            if hdu == 0 and cards.get('SIMPLE') is not True:
+                raise SlaError('utc2tdb_file: ' + fname + ' is not a FITS file')
+            if cards.get('NAXIS', 0):
+                size = 1
+                for k in range(1, cards['NAXIS']+1):
+                    size *= cards['NAXIS' + str(k)]
+                size = abs(cards['BITPIX'])//8*cards.get('GCOUNT', 1)*(size + cards.get('PCOUNT', 0))
+            offset = pos
+            pos   += (size + BLOCK - 1)//BLOCK*BLOCK
+            fptr.seek(pos)
+
+    if cards.get('XTENSION') != 'BINTABLE':
+        raise SlaError('utc2tdb_file: extension ' + str(ext) + ' of ' + fname + ' is not a binary table')
+
+    columns, coff = {}, 0
+    for k in range(1, cards.get('TFIELDS', 0)+1):
+        match = re.match(r'\s*(\d*)([A-Z])', str(cards.get('TFORM' + str(k), '')))
+        if not match or match.group(2) not in FITS_SIZES:
+            raise SlaError('utc2tdb_file: could not interpret TFORM' + str(k) + ' of ' + fname)
+        repeat = int(match.group(1)) if match.group(1) else 1
+        code   = match.group(2)
+        dtype  = FITS_DTYPES.get(code) if repeat == 1 else None
+        column = (coff, dtype, cards.get('TSCAL' + str(k), 1.), cards.get('TZERO' + str(k), 0.))
+        columns[k] = column
+        if 'TTYPE' + str(k) in cards:
+            columns[cards['TTYPE' + str(k)].upper()] = column
+        coff += (repeat + 7)//8 if code == 'X' else repeat*FITS_SIZES[code]
+
+    return offset, cards['NAXIS2'], cards['NAXIS1'], columns
+
+def utc2tdb_file(fname, longitude, latitude, height, ra, dec, pmra=0., pmdec=0., epoch=2000., 
+                 parallax=0., rv=0., outputs=('btdb',), out=None, column='TIME', out_columns=None,
+                 ext=1, raw_dtype='f8', utc_zero=0., utc_scale=1., chunk=1000000, nthreads=1,
+                 mode='exact'):
+    """
+    n = utc2tdb_file(fname, longitude, latitude, height, ra, dec, pmra=0., pmdec=0., epoch=2000.,
+                     parallax=0., rv=0., outputs=('btdb',), out=None, column='TIME', out_columns=None,
+                     ext=1, raw_dtype='f8', utc_zero=0., utc_scale=1., chunk=1000000, nthreads=1,
+                     mode='exact')
+
+    Runs utc2tdb over the utcs stored in file fname, e.g. the arrival times of
+    an event list, writing the outputs chosen from 'tt', 'tdb', 'btdb', 'hutc',
+    'htdb', 'vhel' and 'vbar' to file. Both files are memory-mapped and worked
+    through chunk utcs at a time, each chunk computed in nthreads threads, so
+    no more than a chunk of the data is ever held in memory. Returns the
+    number of utcs.
+
+    fname is either a FITS file, in which case the utcs are column (a name or
+    a number from 1) of binary table extension ext (1 for the first), or a raw
+    file of numbers of type raw_dtype (native order float64 by default); the
+    FITS TSCAL and TZERO of the column are applied. The utc returned by
+    utc2tdb for each value x is utc_zero + utc_scale*x, so that for instance
+    times in seconds since MJDREF can be used with utc_zero=MJDREF and
+    utc_scale=1/86400; the time outputs are written back in the same units,
+    (t-utc_zero)/utc_scale, while vhel and vbar are in km/s.
+
+    With out=None the outputs are written in place: into the existing columns
+    out_columns of the FITS table, one per output, which must be of format D
+    (or E for vhel and vbar) and unscaled, or over the utcs themselves in a raw
+    file, which allows only one output. Otherwise out is the name of a new raw
+    file of native order float64 numbers, one row of len(outputs) per utc,
+    which can be read with numpy.memmap(out, numpy.float64).reshape(n, -1).
 
-    
-    while utc2 - utc1 > acc:
-        utc = utc1 + (elev-el1)/(el2-el1)*(utc2-utc1)
-        (az, el, ref, ra, dec) = sun(utc,longitude,latitude,height,wave,rh,fast)
-        if (el > elev and el1 > elev) or (el < elev and el1 < elev):
-            utc1 = utc
+    The other arguments are as for utc2tdb; mode='interp' is much faster for
+    long files.
+    """
+
+    if isinstance(outputs, str):
+        outputs = (outputs,)
+    for name in outputs:
+        if name not in UTC2TDB_OUTPUTS:
+            raise SlaError('utc2tdb_file: unrecognised output = ' + str(name))
+    if isinstance(out_columns, str):
+        out_columns = (out_columns,)
+    if chunk < 1:
+        raise SlaError('utc2tdb_file: chunk must be at least 1')
+
+    # utcs and, for output in place, the arrays to write to, all views of the
+    # memory-mapped input
+    inplace = out is None
+    fmode   = 'r+' if inplace else 'r'
+    with open(fname, 'rb') as fptr:
+        fits = fptr.read(9) == b'SIMPLE  ='
+
+    if fits:
+        offset, nrow, rowlen, columns = _fits_table(fname, ext)
+        table = np.memmap(fname, np.uint8, fmode, offset, (nrow*rowlen,)) if nrow else None
+
+        def view(name):
+            key = name.upper() if isinstance(name, str) else name
+            if key not in columns or columns[key][1] is None:
+                raise SlaError('utc2tdb_file: no numeric column = ' + str(name) + ' in ' + fname)
+            coff, dtype, tscal, tzero = columns[key]
+            arr = np.ndarray((nrow,), dtype, table, coff, (rowlen,)) if nrow else np.empty(0, dtype)
+            return arr, tscal, tzero
+
+        utc, tscal, tzero = view(column)
+        zero  = utc_zero + utc_scale*tzero
+        scale = utc_scale*tscal
+
+        if inplace:
+            if out_columns is None or len(out_columns) != len(outputs):
+                raise SlaError('utc2tdb_file: out_columns must name one column per output')
+            dests = []
+            for name, ocol in zip(outputs, out_columns):
+                dest, tscal, tzero = view(ocol)
+                if dest.dtype.char != 'd' and not (dest.dtype.char == 'f' and name in ('vhel', 'vbar')):
+                    raise SlaError('utc2tdb_file: column ' + str(ocol) + ' has the wrong format for ' + name)
+                if tscal != 1. or tzero != 0.:
+                    raise SlaError('utc2tdb_file: column ' + str(ocol) + ' is scaled')
+                dests.append(dest)
+        maps = [table]
+
+    else:
+        size = os.path.getsize(fname)
+        utc  = np.memmap(fname, raw_dtype, fmode) if size else np.empty(0, raw_dtype)
+        zero, scale = utc_zero, utc_scale
+        if inplace:
+            if len(outputs) != 1:
+                raise SlaError('utc2tdb_file: in-place output to a raw file allows one output only')
+            if utc.dtype.char != 'd' and not (utc.dtype.char == 'f' and outputs[0] in ('vhel', 'vbar')):
+                raise SlaError('utc2tdb_file: raw_dtype has the wrong type for ' + outputs[0])
+            dests = [utc]
+        maps = [utc]
+
+    ntot = len(utc)
+    if not inplace:
+        if ntot:
+            result = np.memmap(out, np.float64, 'w+', shape=(ntot, len(outputs)))
+            dests  = [result[:,k] for k in range(len(outputs))]
         else:
-            utc2 = utc
-    return utc
+            open(out, 'wb').close()
+            result = dests = None
+        maps.append(result)
+
+    # utc2tdb reads the utcs in place, unless they need scaling, but writes
+    # to contiguous native arrays, so the outputs go through chunk buffers
+    shift = zero != 0. or scale != 1.
+    back  = utc_zero != 0. or utc_scale != 1.
+    ubuf  = np.empty(min(chunk, ntot)) if shift else None
+    bufs  = [np.empty(min(chunk, ntot)) for name in outputs]
+    for start in range(0, ntot, chunk):
+        end = min(start+chunk, ntot)
+        if shift:
+            u = ubuf[:end-start]
+            np.multiply(utc[start:end], scale, out=u)
+            u += zero
+        else:
+            u = utc[start:end]
+
+        outs = [buf[:end-start] for buf in bufs]
+        utc2tdb(u, longitude, latitude, height, ra, dec, pmra, pmdec, epoch,
+                parallax, rv, nthreads=nthreads, mode=mode, outputs=outputs, out=outs)
+
+        for name, res, dest in zip(outputs, outs, dests):
+            if back and name not in ('vhel', 'vbar'):
+                res -= utc_zero
+                res /= utc_scale
+            dest[start:end] = res
+
+    for mm in maps:
+        if isinstance(mm, np.memmap):
+            mm.flush()
+    return ntot
+
+class Batcher(object):
+    """
+    b = Batcher(max_batch=1000, max_delay=0.005, nthreads=1)
+
+    Collects scalar utc2tdb, amass and sun calls submitted from any number of
+    threads and runs them in batches through run_batch, which shares the
+    set-up work between calls at the same site and computes them in nthreads
+    threads without the GIL. A batch is run once max_batch calls are waiting
+    or max_delay seconds after the first of them arrived. For example:
+
+      f = b.submit('amass', utc, longitude, latitude, height, ra, dec)
+      airmass, alt, az, ha, pa, delz = f.result()
+
+    submit returns a concurrent.futures.Future whose result is what the
+    module function would return for the same positional arguments, or which
+    raises the exception it would raise. close() runs any calls still waiting
+    and stops the batching thread; a Batcher can also be used in a with
+    statement.
+    """
+
+    def __init__(self, max_batch=1000, max_delay=0.005, nthreads=1):
+        if max_batch < 1:
+            raise SlaError('Batcher: max_batch must be at least 1')
+        self.max_batch = max_batch
+        self.max_delay = max_delay
+        self.nthreads  = nthreads
+        self._jobs     = []
+        self._futures  = []
+        self._times    = []
+        self._closed   = False
+        self._cond     = threading.Condition()
+        self._thread   = threading.Thread(target=self._run)
+        self._thread.daemon = True
+        self._thread.start()
+
+    def submit(self, name, *args):
+        """
+        future = submit(name, *args)
+
+        Queues the call name(*args), where name is 'utc2tdb', 'amass' or 'sun'
+        and args are positional arguments with a single utc.
+        """
+        future = Future()
+        with self._cond:
+            if self._closed:
+                raise SlaError('Batcher: submit called after close')
+            self._jobs.append((name, tuple(args)))
+            self._futures.append(future)
+            self._times.append(time.time())
+            self._cond.notify()
+        return future
+
+    def close(self):
+        """Runs any calls still waiting and stops the batching thread."""
+        with self._cond:
+            self._closed = True
+            self._cond.notify()
+        self._thread.join()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _run(self):
+        while True:
+            with self._cond:
+                while not self._closed:
+                    if len(self._jobs) >= self.max_batch:
+                        break
+                    if self._jobs:
+                        # the delay runs from the arrival of the oldest call
+                        wait = self._times[0] + self.max_delay - time.time()
+                        if wait <= 0.:
+                            break
+                        self._cond.wait(wait)
+                    else:
+                        self._cond.wait()
+                if self._closed and not self._jobs:
+                    return
+                jobs, futures = self._jobs[:self.max_batch], self._futures[:self.max_batch]
+                del self._jobs[:self.max_batch]
+                del self._futures[:self.max_batch]
+                del self._times[:self.max_batch]
+
+            try:
+                results = run_batch(jobs, self.nthreads)
+            except Exception as err:
+                for future in futures:
+                    future.set_exception(err)
+                continue
 
+            for future, result in zip(futures, results):
+                if isinstance(result, BaseException):
+                    future.set_exception(result)
+                else:
+                    future.set_result(result)
@@ -0,0 +1,245 @@
+#!/usr/bin/env python
+
+"""
+benchmarks for trm.sla
+
+Times the exported functions of trm.sla in three ways: the overhead of
+scalar calls, the throughput of array calls as a function of array size and
+the scaling with the number of threads. The numerical results for a fixed
+set of inputs can be saved to a file and later checked against it so that
+accuracy is tracked along with the speed, and mode='interp' of utc2tdb is
+always checked against mode='exact'. Run as
+
+python -m trm.sla.bench [--max 6] [--save ref.npz] [--check ref.npz]
+
+or via 'python setup.py bench', which builds the extension in place first.
+"""
+
+from __future__ import print_function
+
+import sys
+import time
+import argparse
+import multiprocessing
+import numpy as np
+import trm.sla as sla
+
+# Site (La Palma) and target used throughout
+SITE   = (-17.8792, 28.7624, 2332.)
+TARGET = (12.5, 30.)
+
+AMASS_OUTPUTS = ('airmass', 'alt', 'az', 'ha', 'pa', 'delz')
+SUN_OUTPUTS   = ('az', 'el', 'refract', 'ra', 'dec')
+FK425_OUTPUTS = ('ra', 'dec', 'pmra', 'pmdec', 'parallax', 'rv')
+
+# Largest acceptable change from the reference, by output name, in the
+# units of the output (days, km/s, degrees, hours, arcsec/year etc)
+TOLERANCE = {
+    'tt' : 1.e-10, 'tdb' : 1.e-10, 'btdb' : 1.e-10, 'hutc' : 1.e-10, 'htdb' : 1.e-10,
+    'vhel' : 1.e-6, 'vbar' : 1.e-6,
+    'airmass' : 1.e-6, 'alt' : 1.e-6, 'az' : 1.e-6, 'ha' : 1.e-7, 'pa' : 1.e-5, 'delz' : 1.e-7,
+    'el' : 1.e-6, 'refract' : 1.e-7, 'ra' : 1.e-7, 'dec' : 1.e-6,
+    'glong' : 1.e-8, 'glat' : 1.e-8,
+    'pmra' : 1.e-8, 'pmdec' : 1.e-8, 'parallax' : 1.e-10, 'rv' : 1.e-8,
+    'utc' : 1.e-7,
+}
+
+def best_time(func, repeat=3):
+    """Best wall-clock time of repeat calls of func(), seconds."""
+    best = None
+    for i in range(repeat):
+        t1 = time.time()
+        func()
+        t = time.time() - t1
+        if best is None or t < best:
+            best = t
+    return best
+
+def utcs(n):
+    """n utcs spread over a year, in time order."""
+    return 55000. + np.linspace(0., 365., n)
+
+def reference():
+    """
+    Returns a dictionary of the outputs of each function for a fixed set of
+    inputs, keyed by 'function.output'.
+    """
+    args = SITE + TARGET
+    utc  = utcs(1001)
+    ref  = {}
+    for name, val in zip(sla.UTC2TDB_OUTPUTS, sla.utc2tdb(utc, *args)):
+        ref['utc2tdb.' + name] = val
+    for name, val in zip(AMASS_OUTPUTS, sla.amass(utc, *args)):
+        ref['amass.' + name] = val
+    for fast in (True, False):
+        for name, val in zip(SUN_OUTPUTS, sla.sun(utc, *SITE, fast=fast)):
+            ref['sun%s.%s' % ('' if fast else '_slow', name)] = val
+
+    ra, dec = np.linspace(0., 24., 1001), np.linspace(-89., 89., 1001)
+    for name, val in zip(('glong', 'glat'), sla.eqgal(ra, dec)):
+        ref['eqgal.' + name] = val
+    for name, val in zip(FK425_OUTPUTS, sla.fk425(ra, dec, 0.1, -0.2, 0.05, 20.)):
+        ref['fk425.' + name] = val
+
+    # sunsets of 100 nights
+    mjd = 55000. + np.arange(100.)
+    ref['sun_root.utc'] = sla.sun_root(mjd+0.6, mjd+0.95, -0.25, SITE[0], SITE[1], SITE[2], acc=1.e-9)
+    return ref
+
+def check(fname):
+    """
+    Compares the current results with those saved in fname, printing the
+    largest change of each. Returns the number of outputs changed by more
+    than their tolerance.
+    """
+    saved = np.load(fname)
+    ref   = reference()
+    nbad  = 0
+    print('\nChecks against ' + fname + '\n')
+    for key in sorted(ref):
+        if key not in saved:
+            print('%-20s not in reference file' % key)
+            continue
+        diff = np.abs(ref[key] - saved[key]).max()
+        tol  = TOLERANCE[key.split('.')[1]]
+        ok   = diff <= tol
+        if not ok: nbad += 1
+        print('%-20s max change = %-10.3g tolerance = %-8.3g %s' % (key, diff, tol, 'ok' if ok else 'FAILED'))
+    return nbad
+
+# Largest acceptable differences between mode='interp' and mode='exact' in
+# utc2tdb: 0.1 microseconds in the times (days) and 1 mm/s in the velocities
+INTERP_TOLERANCE = {'tt' : 0., 'tdb' : 1.e-7/86400., 'btdb' : 1.e-7/86400., 'hutc' : 1.e-7/86400.,
+                    'htdb' : 1.e-7/86400., 'vhel' : 1.e-6, 'vbar' : 1.e-6}
+
+def interp_check():
+    """
+    Compares utc2tdb with mode='interp' to mode='exact' at sites well away
+    from longitude 0, where errors in the topocentric terms would show up,
+    printing the largest differences. Returns the number of outputs which
+    differ by more than INTERP_TOLERANCE.
+    """
+    utc  = utcs(100001)
+    nbad = 0
+    print('\nmode=interp against mode=exact\n')
+    for site in (SITE, (150., -31.3, 1150.), (-110., 31.9, 2000.)):
+        exact  = sla.utc2tdb(utc, *(site + TARGET))
+        interp = sla.utc2tdb(utc, *(site + TARGET), mode='interp')
+        for name, ve, vi in zip(sla.UTC2TDB_OUTPUTS, exact, interp):
+            diff = np.abs(vi - ve).max()
+            tol  = INTERP_TOLERANCE[name]
+            ok   = diff <= tol
+            if not ok: nbad += 1
+            print('longitude %7.2f %-6s max diff = %-10.3g tolerance = %-8.3g %s' %
+                  (site[0], name, diff, tol, 'ok' if ok else 'FAILED'))
+    return nbad
+
+def scalar_overhead(ncall):
+    """Prints the time per call of each function with scalar arguments."""
+    args = SITE + TARGET
+    site = sla.Observatory(*SITE)
+    targ = sla.Target(*TARGET)
+    tests = [
+        ('utc2tdb',             lambda : sla.utc2tdb(55000.1, *args)),
+        ('Observatory.utc2tdb', lambda : site.utc2tdb(55000.1, targ)),
+        ('amass',               lambda : sla.amass(55000.1, *args)),
+        ('Observatory.amass',   lambda : site.amass(55000.1, targ)),
+        ('sun',                 lambda : sla.sun(55000.1, *SITE)),
+        ('sun, fast=False',     lambda : sla.sun(55000.1, *SITE, fast=False)),
+        ('eqgal',               lambda : sla.eqgal(12.5, 30.)),
+        ('galeq',               lambda : sla.galeq(120., 30.)),
+        ('fk425',               lambda : sla.fk425(12.5, 30.)),
+        ('sun_at_elev',         lambda : sla.sun_at_elev(SITE[0], SITE[1], SITE[2], 55000.6, 55000.95, -0.25)),
+    ]
+    print('\nScalar calls, microseconds per call\n')
+    for name, func in tests:
+        n = ncall // 10 if name.startswith('sun_at') else ncall
+        def loop():
+            for i in range(n):
+                func()
+        print('%-22s %10.2f' % (name, 1.e6*best_time(loop)/n))
+
+def array_tests(nthreads):
+    """Returns (name, func(n)) for the array benchmarks."""
+    args = SITE + TARGET
+    ras  = np.linspace(0., 24., 10)
+    decs = np.linspace(-20., 60., 10)
+    return [
+        ('utc2tdb',          lambda n : sla.utc2tdb(utcs(n), *args, nthreads=nthreads)),
+        ('utc2tdb, interp',  lambda n : sla.utc2tdb(utcs(n), *args, nthreads=nthreads, mode='interp')),
+        ('utc2tdb btdb only',lambda n : sla.utc2tdb(utcs(n), *args, nthreads=nthreads, outputs='btdb')),
+        ('utc2tdb_batch x10',lambda n : sla.utc2tdb_batch(utcs(n//10), SITE[0], SITE[1], SITE[2], ras, decs,
+                                                          nthreads=nthreads)),
+        ('amass',            lambda n : sla.amass(utcs(n), *args)),
+        ('amass_batch x10',  lambda n : sla.amass_batch(utcs(n//10), SITE[0], SITE[1], SITE[2], ras, decs,
+                                                        nthreads=nthreads)),
+        ('sun',              lambda n : sla.sun(utcs(n), *SITE, nthreads=nthreads)),
+        ('sun, fast=False',  lambda n : sla.sun(utcs(n), *SITE, fast=False, nthreads=nthreads)),
+        ('eqgal',            lambda n : sla.eqgal(np.linspace(0., 24., n), 30., nthreads=nthreads)),
+        ('fk425',            lambda n : sla.fk425(np.linspace(0., 24., n), 30., nthreads=nthreads)),
+        ('sun_root',         lambda n : sla.sun_root(55000.6+np.arange(n//100), 55000.95+np.arange(n//100),
+                                                     -0.25, *SITE, nthreads=nthreads)),
+    ]
+
+def throughput(nmax, nthreads):
+    """Prints samples per second against array size from 10**3 to 10**nmax."""
+    sizes = [10**k for k in range(3, nmax+1)]
+    print('\nArray calls, nthreads = %d, millions of samples per second\n' % nthreads)
+    print('%-20s' % 'n' + ''.join(['%10d' % n for n in sizes]))
+    for name, func in array_tests(nthreads):
+        speeds = []
+        for n in sizes:
+            speeds.append(n/best_time(lambda : func(n), 3 if n < 10**6 else 1)/1.e6)
+        print('%-20s' % name + ''.join(['%10.3f' % s for s in speeds]))
+
+def scaling(n):
+    """Prints the speed up relative to one thread for arrays of length n."""
+    ncpu = multiprocessing.cpu_count()
+    nthreads = [1]
+    while 2*nthreads[-1] <= ncpu:
+        nthreads.append(2*nthreads[-1])
+    if nthreads[-1] != ncpu:
+        nthreads.append(ncpu)
+
+    print('\nThread scaling, n = %d, speed up over one thread\n' % n)
+    print('%-20s' % 'nthreads' + ''.join(['%8d' % nt for nt in nthreads]))
+    # sla.amass takes no nthreads argument
+    names = [name for name, func in array_tests(1) if name != 'amass']
+    for name in names:
+        times = []
+        for nt in nthreads:
+            func = dict(array_tests(nt))[name]
+            times.append(best_time(lambda : func(n), 1))
+        print('%-20s' % name + ''.join(['%8.2f' % (times[0]/t) for t in times]))
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='benchmarks and accuracy checks for trm.sla')
+    parser.add_argument('--max', type=int, default=6, help='log10 of the largest array size (3 to 7)')
+    parser.add_argument('--ncall', type=int, default=10000, help='number of scalar calls to time')
+    parser.add_argument('--save', help='file to save the reference results to')
+    parser.add_argument('--check', help='file of reference results to check against')
+    parser.add_argument('--no-timing', action='store_true', help='only check or save results')
+    args = parser.parse_args(argv)
+
+    if args.max < 3 or args.max > 7:
+        parser.error('--max must lie in the range 3 to 7')
+
+    if args.save:
+        np.savez(args.save, **reference())
+        print('Saved reference results to ' + args.save)
+
+    nbad = check(args.check) if args.check else 0
+    nbad += interp_check()
+
+    if not args.no_timing:
+        scalar_overhead(args.ncall)
+        throughput(args.max, 1)
+        scaling(10**args.max)
+
+    if nbad:
+        print('\n%d outputs changed by more than their tolerance' % nbad)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -3,13 +3,2532 @@
 //
 
 #include <Python.h>
+#include "structmember.h"
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include "numpy/arrayobject.h"
+#include "numpy/ufuncobject.h"
 #include "slalib.h"
 #include "slamac.h"
 #include "trm/vec3.h"
 #include "trm/constants.h"
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <system_error>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef SLA_PROFILE
+#include <atomic>
+#include <chrono>
+#endif
+
+// Critical sections on an object only exist from Python 3.13, for the free-
+// threaded build; before that the GIL serves the same purpose.
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+// Returns the number of threads to use given a user's request, where
+// nthreads < 1 means one per core.
+
+static int
+nthreads_to_use(int nthreads)
+{
+    if(nthreads < 1){
+        nthreads = std::thread::hardware_concurrency();
+        if(nthreads < 1) nthreads = 1;
+    }
+    return nthreads;
+}
+
+// Runs func(i1,i2) over the index range 0 to n-1 split into nthreads
+// contiguous chunks, one per thread. nthreads < 1 means one thread per
+// core. func must not touch Python objects as this is designed to be called
+// with the GIL released.
+
+template <class Func>
+static void
+parallel_for(npy_intp n, int nthreads, Func func)
+{
+    nthreads = nthreads_to_use(nthreads);
+    if(npy_intp(nthreads) > n) nthreads = n > 0 ? int(n) : 1;
+
+    if(nthreads == 1){
+        func(npy_intp(0), n);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    npy_intp chunk = n / nthreads, extra = n % nthreads, i1 = 0;
+    for(int i=0; i<nthreads; i++){
+        npy_intp i2 = i1 + chunk + (i < extra ? 1 : 0);
+        try{
+            workers.push_back(std::thread(func, i1, i2));
+        }
+        catch(const std::system_error&){
+            // could not start a thread; do this chunk ourselves
+            func(i1, i2);
+        }
+        i1 = i2;
+    }
+    for(size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+// Stages of the calculations which are timed when compiled with
+// -DSLA_PROFILE (see setup.py). The first three are whole calls of
+// utc2tdb, amass and sun (and their batch forms) including the conversion
+// of inputs and outputs, the rest are parts of them, summed over threads.
+
+enum Stage {
+    ST_UTC2TDB, ST_AMASS, ST_SUN, ST_DTT, ST_RCC, ST_EPHEM, ST_NUTATION, ST_ETAB,
+    ST_OBSERVER, ST_TARGET, ST_MAPPA, ST_AOPPA, ST_APPARENT, ST_REFRACTION, NSTAGE
+};
+
+static const char *STAGE_NAMES[NSTAGE] = {
+    "utc2tdb", "amass", "sun", "slaDtt", "slaRcc", "ephemeris", "nutation", "earth_table",
+    "observer", "target", "slaMappa", "slaAoppa", "apparent", "refraction"
+};
+
+#ifdef SLA_PROFILE
+
+// Nanoseconds spent and number of calls per stage
+static std::atomic<unsigned long long> stage_ns[NSTAGE], stage_calls[NSTAGE];
+
+// Adds the time from its construction to its destruction to a stage
+
+class Stage_timer {
+public:
+    Stage_timer(Stage stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+
+    ~Stage_timer(){
+        std::chrono::nanoseconds dt = std::chrono::steady_clock::now() - start;
+        stage_ns[stage].fetch_add(dt.count(), std::memory_order_relaxed);
+        stage_calls[stage].fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    Stage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+// PROFILE times the rest of the enclosing scope; PROFILE_CALL a single
+// statement
+#define PROFILE(stage) Stage_timer stage_timer_(stage)
+#define PROFILE_CALL(stage, statement) do { Stage_timer stage_timer_(stage); statement; } while(0)
+
+#else
+
+#define PROFILE(stage)
+#define PROFILE_CALL(stage, statement) statement
+
+#endif
+
+// Marks a function to be compiled for several x86-64 instruction sets, the
+// best being selected when the module is loaded. Needs gcc's ifunc support.
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 && defined(__x86_64__) && defined(__linux__)
+#define SLA_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SLA_CLONES
+#endif
+
+// Observatory position in the form needed by the time routines, along
+// with the Earth orientation parameters which slaAoppa takes with it
+
+struct Site {
+    double longr;  // longitude, radians, east positive
+    double latr;   // latitude, radians
+    double height; // height, metres
+    double u, v;   // distance from spin axis and equatorial plane, km
+    double dut;    // UT1-UTC, seconds
+    double xp, yp; // polar motion, radians
+};
+
+// Target position and space motion in the form needed by slaPm, along
+// with the Cartesian form of the same used by star_direction.
+
+struct Star {
+    double rar, decr;     // ICRS ra, dec, radians
+    double pmrar, pmdecr; // proper motions, radians/year
+    double parallax;      // arcsec
+    double rv;            // km/s
+    double epoch;         // epoch of position, Julian years
+    double p0[3];         // unit vector at epoch
+    double em[3];         // space motion, radians/year
+};
+
+// Returns the direction to a target at epoch nepoch (Julian years). This
+// is the first half of slaPm, which adds a fixed space-motion vector to the
+// catalogue unit vector, so that the motion is set up once per target
+// rather than once per epoch. The vector is not quite of unit length.
+
+static inline void
+star_direction(const Star& star, double nepoch, double p[3])
+{
+    double t = nepoch - star.epoch;
+    for(int i=0; i<3; i++)
+        p[i] = star.p0[i] + t*star.em[i];
+}
+
+// Atmospheric parameters needed for refraction
+
+struct Atmosphere {
+    double wave;       // wavelength, microns
+    double T;          // ambient temperature, K
+    double P;          // ambient pressure, mbar
+    double rh;         // relative humidity (0-1)
+    double tlr;        // lapse rate, K/metre
+    double refa, refb; // refraction constants from slaRefcoq
+};
+
+// Results of utc2tdb for a single UTC
+
+struct Tdb_result {
+    double tt, tdb, btdb, hutc, htdb, vhel, vbar;
+};
+
+// Results of amass for a single UTC
+
+struct Amass_result {
+    double airmass, alt, az, ha, pa, delz;
+};
+
+// Names of the results of utc2tdb and amass, in the order of the structures
+// above. Output k can be selected with bit k of a mask, see set_outputs.
+
+static const char *TDB_OUTPUTS[]   = {"tt", "tdb", "btdb", "hutc", "htdb", "vhel", "vbar"};
+static const int NTDB = 7;
+static const char *AMASS_OUTPUTS[] = {"airmass", "alt", "az", "ha", "pa", "delz"};
+static const int NAMASS = 6;
+
+// Which of the above are times, which are always returned as float64
+// because float32 would lose far too much precision
+
+static const bool TDB_TIME[]   = {true, true, true, true, true, false, false};
+static const bool AMASS_TIME[] = {false, false, false, false, false, false};
+static const unsigned ALL_OUTPUTS = ~0u;
+
+static inline void
+result_values(const Tdb_result& r, double *v)
+{
+    v[0] = r.tt;
+    v[1] = r.tdb;
+    v[2] = r.btdb;
+    v[3] = r.hutc;
+    v[4] = r.htdb;
+    v[5] = r.vhel;
+    v[6] = r.vbar;
+}
+
+static inline void
+result_values(const Amass_result& r, double *v)
+{
+    v[0] = r.airmass;
+    v[1] = r.alt;
+    v[2] = r.az;
+    v[3] = r.ha;
+    v[4] = r.pa;
+    v[5] = r.delz;
+}
+
+// Results of sun for a single UTC
+
+struct Sun_result {
+    double az, el, refract, ra, dec;
+};
+
+// The following routines convert user inputs into the structures above
+// without any checks. They do not touch Python objects.
+
+static void
+make_site(double longitude, double latitude, double height, Site& site)
+{
+    const double CFAC = Constants::PI/180.;
+    site.latr   = CFAC*latitude;
+    site.longr  = CFAC*longitude;
+    site.height = height;
+
+    slaGeoc( site.latr, site.height, &site.u, &site.v);
+    site.u *= Constants::AU/1000.0;
+    site.v *= Constants::AU/1000.0;
+
+    site.dut = site.xp = site.yp = 0.;
+}
+
+// UT1-UTC in seconds, polar motion in arcsec
+
+static void
+make_eop(double dut, double xp, double yp, Site& site)
+{
+    site.dut = dut;
+    site.xp  = DAS2R*xp;
+    site.yp  = DAS2R*yp;
+}
+
+static void
+make_star(double ra, double dec, double pmra, double pmdec, double epoch, 
+          double parallax, double rv, Star& star)
+{
+    const double CFAC = Constants::PI/180.;
+    star.rar      = CFAC*15.*ra;
+    star.decr     = CFAC*dec;
+    star.pmrar    = CFAC*pmra/3600.;
+    star.pmdecr   = CFAC*pmdec/3600.;
+    star.parallax = parallax;
+    star.rv       = rv;
+    star.epoch    = epoch;
+
+    // space motion as computed by slaPm; the constant converts km/s to
+    // AU/year multiplied by arcsec to radians
+    const double VFR = (365.25*86400.0/149597870.0)*DAS2R;
+    slaDcs2c(star.rar, star.decr, star.p0);
+    double w = VFR*star.rv*star.parallax;
+    star.em[0] = -star.pmrar*star.p0[1] - star.pmdecr*cos(star.rar)*sin(star.decr) + w*star.p0[0];
+    star.em[1] =  star.pmrar*star.p0[0] - star.pmdecr*sin(star.rar)*sin(star.decr) + w*star.p0[1];
+    star.em[2] =                          star.pmdecr*cos(star.decr)               + w*star.p0[2];
+}
+
+static void
+make_atmos(double wave, double rh, Atmosphere& atmos, double T=285., double P=1013.25, 
+           double tlr=0.0065)
+{
+    atmos.wave = wave;
+    atmos.T    = T;
+    atmos.P    = P;
+    atmos.rh   = rh;
+    atmos.tlr  = tlr;
+    slaRefcoq(atmos.T, atmos.P, atmos.rh, atmos.wave, &atmos.refa, &atmos.refb);
+}
+
+// The following routines check and convert user inputs into the structures
+// above. They return false, with a Python exception set, if there is a
+// problem. 'name' is used to prefix error messages.
+
+static bool
+set_site(const std::string& name, double longitude, double latitude, double height, Site& site)
+{
+    if(longitude < -360. || longitude > +360.){
+	PyErr_SetString(PyExc_ValueError, (name + ": longitude out of range -360 to +360").c_str());
+	return false;
+    }
+
+    if(latitude < -90. || latitude > +90.){
+	PyErr_SetString(PyExc_ValueError, (name + ": latitude out of range -90 to +90").c_str());
+	return false;
+    }
+
+    make_site(longitude, latitude, height, site);
+    return true;
+}
+
+static bool
+set_star(const std::string& name, double ra, double dec, double pmra, double pmdec, 
+         double epoch, double parallax, double rv, Star& star)
+{
+    if(ra < 0. || ra > 24.){
+	PyErr_SetString(PyExc_ValueError, (name + ": ra out of range 0 to 24").c_str());
+	return false;
+    }
+
+    if(dec < -90. || dec > +90.){
+	PyErr_SetString(PyExc_ValueError, (name + ": declination out of range -90 to +90").c_str());
+	return false;
+    }
+
+    make_star(ra, dec, pmra, pmdec, epoch, parallax, rv, star);
+    return true;
+}
+
+static bool
+set_eop(const std::string& name, double dut, double xp, double yp, Site& site)
+{
+    if(dut < -1. || dut > +1.){
+	PyErr_SetString(PyExc_ValueError, (name + ": dut out of range -1 to +1").c_str());
+	return false;
+    }
+
+    if(xp < -1. || xp > +1. || yp < -1. || yp > +1.){
+	PyErr_SetString(PyExc_ValueError, (name + ": polar motion out of range -1 to +1").c_str());
+	return false;
+    }
+
+    make_eop(dut, xp, yp, site);
+    return true;
+}
+
+static bool
+set_atmos(const std::string& name, double wave, double rh, Atmosphere& atmos,
+          double T=285., double P=1013.25, double tlr=0.0065)
+{
+    if(wave <= 0. || wave > 1000000.){
+	PyErr_SetString(PyExc_ValueError, (name + ": wavelength out of range 0 to 1000000").c_str());
+	return false;
+    }
+
+    if(rh < 0. || rh > 1.){
+	PyErr_SetString(PyExc_ValueError, (name + ": relative humidity out of range 0 to 1").c_str());
+	return false;
+    }
+
+    if(T < 100. || T > 500.){
+	PyErr_SetString(PyExc_ValueError, (name + ": temperature out of range 100 to 500").c_str());
+	return false;
+    }
+
+    if(P < 0. || P > 2000.){
+	PyErr_SetString(PyExc_ValueError, (name + ": pressure out of range 0 to 2000").c_str());
+	return false;
+    }
+
+    if(tlr < 0.001 || tlr > 0.01){
+	PyErr_SetString(PyExc_ValueError, (name + ": lapse rate out of range 0.001 to 0.01").c_str());
+	return false;
+    }
+
+    make_atmos(wave, rh, atmos, T, P, tlr);
+    return true;
+}
+
+// Checks the utc argument of utc2tdb etc which can be a number or a 1D
+// array. scalar is set true if it is a number, in which case vutc is
+// set to its value.
+
+static bool
+check_utc(const std::string& name, PyObject *iutc, bool& scalar, double& vutc)
+{
+    if(iutc){
+        if(PyArray_Check(iutc)){
+            int nd = PyArray_NDIM((PyArrayObject*)iutc);
+            if(nd != 1){
+                PyErr_SetString(PyExc_ValueError, (name + ": utc must be a 1D array or a float").c_str());
+                return false;
+            }
+            scalar = false;
+        }else{
+            vutc = PyFloat_AsDouble(iutc);
+            if(PyErr_Occurred()){
+                PyErr_SetString(PyExc_TypeError, (name + ": utc must be a 1D array or a float").c_str());
+                return false;
+            }
+            scalar = true;
+        }
+    }else{
+        PyErr_SetString(PyExc_ValueError, (name + ": utc not defined").c_str());
+        return false;
+    }
+    return true;
+}
+
+// Read-only access to 1D array arguments such as utc. 1D float64 and
+// float32 arrays of either byte order are read in place whatever their
+// strides, so that slices and columns of (memory-mapped) FITS tables are not
+// copied. Other types are converted to a temporary float64 array. A single
+// value can be stored instead, which is then returned for any index.
+// Reading values does not need the GIL.
+
+class Array_input {
+public:
+
+    Array_input() : obj(NULL), data((const char*)&value), stride(0), n(1), kind(F8), value(0.) {}
+
+    ~Array_input(){
+        Py_XDECREF(obj);
+    }
+
+    // Sets up access to a 1D array, returning false with an exception set
+    // if there is a problem.
+    bool set(PyObject *iutc);
+
+    // Stores a single value
+    void set(double utc){
+        value  = utc;
+        data   = (const char*)&value;
+        stride = 0;
+        n      = 1;
+        kind   = F8;
+    }
+
+    // Number of values
+    npy_intp size() const {
+        return n;
+    }
+
+    // Returns value i
+    double operator[](npy_intp i) const {
+        const char *p = data + i*stride;
+        unsigned char b[8];
+        double d;
+        float f;
+        switch(kind){
+        case F8:
+            memcpy(&d, p, 8);
+            return d;
+        case F8_SWAP:
+            for(int k=0; k<8; k++) b[k] = p[7-k];
+            memcpy(&d, b, 8);
+            return d;
+        case F4:
+            memcpy(&f, p, 4);
+            return f;
+        default:
+            for(int k=0; k<4; k++) b[k] = p[3-k];
+            memcpy(&f, b, 4);
+            return f;
+        }
+    }
+
+private:
+
+    enum Kind {F8, F8_SWAP, F4, F4_SWAP};
+
+    PyObject *obj;
+    const char *data;
+    npy_intp stride, n;
+    Kind kind;
+    double value;
+
+    // not copyable because of the reference held
+    Array_input(const Array_input&);
+    Array_input& operator=(const Array_input&);
+};
+
+bool Array_input::set(PyObject *iutc)
+{
+    Py_XDECREF(obj);
+    obj = NULL;
+
+    PyArrayObject *arr = (PyArrayObject*)iutc;
+    int type = PyArray_TYPE(arr);
+    if(PyArray_NDIM(arr) == 1 && (type == NPY_DOUBLE || type == NPY_FLOAT)){
+        bool swap = !PyArray_ISNOTSWAPPED(arr);
+        if(type == NPY_DOUBLE)
+            kind = swap ? F8_SWAP : F8;
+        else
+            kind = swap ? F4_SWAP : F4;
+        Py_INCREF(iutc);
+        obj = iutc;
+    }else{
+        obj = PyArray_FROM_OTF(iutc, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+        if(obj == NULL) return false;
+        kind = F8;
+    }
+
+    arr    = (PyArrayObject*)obj;
+    data   = PyArray_BYTES(arr);
+    n      = PyArray_SIZE(arr);
+    stride = PyArray_NDIM(arr) ? PyArray_STRIDE(arr, 0) : 0;
+    return true;
+}
+
+// Interprets the mode argument of utc2tdb
+
+static bool
+set_mode(const std::string& name, const char *mode, bool& interp)
+{
+    if(strcmp(mode, "exact") == 0){
+        interp = false;
+    }else if(strcmp(mode, "interp") == 0){
+        interp = true;
+    }else{
+	PyErr_SetString(PyExc_ValueError, (name + ": mode must be either 'exact' or 'interp'").c_str());
+	return false;
+    }
+    return true;
+}
+
+// Converts target parameters, each of which can be a number or a 1D array,
+// into a vector of Stars. All arrays must have the same length; numbers
+// apply to all targets. NULL arguments take their usual default values.
+
+static bool
+set_stars(const std::string& name, PyObject *ra, PyObject *dec, PyObject *pmra, 
+          PyObject *pmdec, PyObject *epoch, PyObject *parallax, PyObject *rv,
+          std::vector<Star>& stars)
+{
+    const int NPAR = 7;
+    const char *pnames[NPAR] = {"ra", "dec", "pmra", "pmdec", "epoch", "parallax", "rv"};
+    PyObject *objs[NPAR]     = {ra, dec, pmra, pmdec, epoch, parallax, rv};
+    double defs[NPAR]        = {0., 0., 0., 0., 2000., 0., 0.};
+
+    // convert to arrays, checking dimensions
+    PyArrayObject *arrs[NPAR] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    npy_intp n = -1;
+    bool ok = true;
+    for(int i=0; i<NPAR && ok; i++){
+        if(objs[i] == NULL) continue;
+        arrs[i] = (PyArrayObject*) PyArray_FROM_OTF(objs[i], NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+        if(arrs[i] == NULL){
+            ok = false;
+        }else if(PyArray_NDIM(arrs[i]) > 1){
+            PyErr_SetString(PyExc_ValueError, (name + ": " + pnames[i] + 
+                                               " must be a 1D array or a float").c_str());
+            ok = false;
+        }else if(PyArray_NDIM(arrs[i]) == 1){
+            npy_intp na = PyArray_SIZE(arrs[i]);
+            if(n == -1){
+                n = na;
+            }else if(na != n){
+                PyErr_SetString(PyExc_ValueError, (name + ": " + pnames[i] + 
+                                                   " does not match the length of earlier target arrays").c_str());
+                ok = false;
+            }
+        }
+    }
+
+    if(ok){
+        if(n == -1) n = 1;
+        stars.resize(n);
+        double vals[NPAR];
+        for(npy_intp j=0; j<n && ok; j++){
+            for(int i=0; i<NPAR; i++){
+                if(arrs[i] == NULL){
+                    vals[i] = defs[i];
+                }else{
+                    const double *ptr = (const double*)PyArray_DATA(arrs[i]);
+                    vals[i] = PyArray_NDIM(arrs[i]) ? ptr[j] : ptr[0];
+                }
+            }
+            ok = set_star(name + ", target " + Subs::str(j), vals[0], vals[1], vals[2], 
+                          vals[3], vals[4], vals[5], vals[6], stars[j]);
+        }
+    }
+
+    for(int i=0; i<NPAR; i++)
+        Py_XDECREF(arrs[i]);
+
+    return ok;
+}
+
+// Sets up narg inputs of a vectorised function, each of which can be a
+// number or a 1D array. NULL arguments take the values in defs. All arrays
+// must have the same length, n; numbers apply to all elements. scalar is
+// set true if there are no arrays, in which case n = 1.
+
+static bool
+set_inputs(const std::string& name, int narg, PyObject **objs, const char **pnames,
+           const double *defs, Array_input *ins, npy_intp& n, bool& scalar)
+{
+    n      = 1;
+    scalar = true;
+    for(int i=0; i<narg; i++){
+        if(objs[i] == NULL){
+            ins[i].set(defs[i]);
+        }else if(PyArray_Check(objs[i])){
+            if(PyArray_NDIM((PyArrayObject*)objs[i]) != 1){
+                PyErr_SetString(PyExc_ValueError, (name + ": " + pnames[i] + 
+                                                   " must be a 1D array or a float").c_str());
+                return false;
+            }
+            if(!ins[i].set(objs[i])) return false;
+            if(scalar){
+                n      = ins[i].size();
+                scalar = false;
+            }else if(ins[i].size() != n){
+                PyErr_SetString(PyExc_ValueError, (name + ": " + pnames[i] + 
+                                                   " does not match the length of earlier arrays").c_str());
+                return false;
+            }
+        }else{
+            double v = PyFloat_AsDouble(objs[i]);
+            if(PyErr_Occurred()){
+                PyErr_SetString(PyExc_TypeError, (name + ": " + pnames[i] + 
+                                                  " must be a 1D array or a float").c_str());
+                return false;
+            }
+            ins[i].set(v);
+        }
+    }
+    return true;
+}
+
+// Extracts the Stars from a sequence of Target objects, instances of
+// target_type. Defined with the Target type.
+
+static bool
+get_stars(const std::string& name, PyTypeObject *target_type, PyObject *targets, 
+          std::vector<Star>& stars);
+
+// Tabulates the position and velocity of the Earth relative to the helio-
+// and barycentres (slaEpv), the precession-nutation matrix (slaPneqx) and
+// the equation of the equinoxes (slaEqeqx) on a regular grid of TDB so that
+// they can be interpolated when many closely-spaced times are needed. The
+// positions and velocities are interpolated with cubic Hermite polynomials,
+// the others linearly. With the default step of 0.5 days, the errors are
+// of order metres in position (well under 0.1 microseconds in light travel
+// time) and 1 mm/s in velocity.
+//
+// TDB-TT (slaRcc) is tabulated too. Its topocentric terms are all of the
+// form u*sin(tsol+f(t)) or v*g(t) where tsol is the local solar time and f, g
+// vary slowly, so slaRcc = G(t) + u*(A(t)*sin(tsol) + B(t)*cos(tsol)) + v*C(t).
+// G, A, B and C are found from slaRcc at each node and interpolated with
+// 4-point Lagrange polynomials; over 0.5 days the error is far below 1 ns.
+//
+// None of this depends upon the site, so a table can also be a view of part
+// of a Table_file mapped from disk.
+
+class Table_file;
+
+class Earth_table {
+public:
+
+    // Default grid spacing, days
+    static const double STEP;
+
+    // Maximum number of nodes, to guard against absurd time ranges
+    static const npy_intp MAXNODE = 1000000;
+
+    // Builds a table covering TDBs t1 to t2
+    Earth_table(double t1, double t2, double step, int nthreads);
+
+    // Refers to n nodes of a mapped file starting at node i0
+    Earth_table(std::shared_ptr<const Table_file> file, npy_intp i0, npy_intp n);
+
+    // Interpolates the table at TDB = tdb
+    void eval(double tdb, double ph[3], double vh[3], double pb[3], double vb[3],
+              double rnpb[3][3], double& eqeqx) const;
+
+    // Interpolated equivalent of slaRcc, same arguments (wl is the west
+    // longitude, as for slaRcc)
+    double rcc(double tdb, double ut, double wl, double u, double v) const;
+
+    // Number of nodes needed to cover t1 to t2, at least 4 for rcc
+    static npy_intp nnode(double t1, double t2, double step){
+        return std::max(npy_intp(std::ceil(t2/step) - std::floor(t1/step)) + 3, npy_intp(4));
+    }
+
+    // Layout of each node: ph, vh, pb, vb, rnpb, eqeqx and the G, A, B and
+    // C terms of slaRcc (A, B and C per km)
+    enum {PH=0, VH=3, PB=6, VB=9, RNPB=12, EQEQX=21, RCCG=22, RCCA=23, RCCB=24, RCCC=25, NDATA=26};
+
+    // TDB of the first node, the node spacing, the number of nodes and
+    // their data, as written to a Table_file
+    double start() const { return t0; }
+    double spacing() const { return step; }
+    npy_intp size() const { return nnodes; }
+    const double *nodes() const { return data; }
+
+private:
+
+    double t0, step;
+    npy_intp nnodes;
+    std::vector<double> store;              // nodes, if built
+    std::shared_ptr<const Table_file> file; // keeps mapped nodes valid
+    const double *data;                     // the nodes in use
+
+};
+
+const double Earth_table::STEP = 0.5;
+
+Earth_table::Earth_table(double t1, double t2, double step_, int nthreads) :
+    t0(step_*(std::floor(t1/step_)-1.)), step(step_), nnodes(nnode(t1, t2, step_)),
+    store(nnodes*NDATA), data(store.data())
+{
+    parallel_for(nnodes, nthreads, [this](npy_intp i1, npy_intp i2){
+            for(npy_intp i=i1; i<i2; i++){
+                double *p = &store[NDATA*i];
+                double t  = t0 + step*i;
+                slaEpv(t, p+PH, p+VH, p+PB, p+VB);
+                double rnpb[3][3];
+                slaPneqx(t, rnpb);
+                for(int j=0; j<3; j++)
+                    for(int k=0; k<3; k++)
+                        p[RNPB+3*j+k] = rnpb[j][k];
+                p[EQEQX] = slaEqeqx(t);
+
+                // tsol = 0 gives B, tsol = pi/2 gives A
+                const double UNIT = 1000.;
+                p[RCCG] = slaRcc(t, 0., 0., 0., 0.);
+                p[RCCA] = (slaRcc(t, 0.25, 0., UNIT, 0.) - p[RCCG])/UNIT;
+                p[RCCB] = (slaRcc(t, 0., 0., UNIT, 0.) - p[RCCG])/UNIT;
+                p[RCCC] = (slaRcc(t, 0., 0., 0., UNIT) - p[RCCG])/UNIT;
+            }
+        });
+}
+
+void Earth_table::eval(double tdb, double ph[3], double vh[3], double pb[3], double vb[3],
+                       double rnpb[3][3], double& eqeqx) const
+{
+    // locate interval, clamping to the ends (with care over NaNs)
+    double x = (tdb-t0)/step;
+    npy_intp k = x >= 0. ? npy_intp(x) : 0;
+    if(k > nnodes-2) k = nnodes-2;
+    double s = x - k;
+
+    const double *p0 = &data[NDATA*k];
+    const double *p1 = p0 + NDATA;
+
+    // Hermite basis functions and their derivatives
+    double s2 = s*s, s3 = s2*s;
+    double h00 = 2.*s3-3.*s2+1., h10 = step*(s3-2.*s2+s);
+    double h01 = 3.*s2-2.*s3,    h11 = step*(s3-s2);
+    double d00 = (6.*s2-6.*s)/step, d10 = 3.*s2-4.*s+1.;
+    double d01 = -d00,              d11 = 3.*s2-2.*s;
+
+    for(int j=0; j<3; j++){
+        ph[j] = h00*p0[PH+j] + h10*p0[VH+j] + h01*p1[PH+j] + h11*p1[VH+j];
+        vh[j] = d00*p0[PH+j] + d10*p0[VH+j] + d01*p1[PH+j] + d11*p1[VH+j];
+        pb[j] = h00*p0[PB+j] + h10*p0[VB+j] + h01*p1[PB+j] + h11*p1[VB+j];
+        vb[j] = d00*p0[PB+j] + d10*p0[VB+j] + d01*p1[PB+j] + d11*p1[VB+j];
+    }
+
+    for(int j=0; j<3; j++)
+        for(int k=0; k<3; k++)
+            rnpb[j][k] = p0[RNPB+3*j+k] + s*(p1[RNPB+3*j+k]-p0[RNPB+3*j+k]);
+
+    eqeqx = p0[EQEQX] + s*(p1[EQEQX]-p0[EQEQX]);
+}
+
+double Earth_table::rcc(double tdb, double ut, double wl, double u, double v) const
+{
+    double x = (tdb-t0)/step;
+    npy_intp k = x >= 1. ? npy_intp(x) : 1;
+    if(k > nnodes-3) k = nnodes-3;
+    double s = x - k;
+
+    // Lagrange weights for nodes k-1 to k+2
+    double sm1 = s-1., sm2 = s-2., sp1 = s+1.;
+    double w[4] = {-s*sm1*sm2/6., sp1*sm1*sm2/2., -sp1*s*sm2/2., sp1*s*sm1/6.};
+
+    double terms[4] = {0., 0., 0., 0.};
+    const double *p = &data[NDATA*(k-1)];
+    for(int n=0; n<4; n++, p+=NDATA)
+        for(int j=0; j<4; j++)
+            terms[j] += w[n]*p[RCCG+j];
+
+    // local solar time as defined by slaRcc
+    double tsol = Constants::TWOPI*ut - wl;
+    return terms[0] + u*(terms[1]*sin(tsol) + terms[2]*cos(tsol)) + v*terms[3];
+}
+
+// A file of Earth_table nodes written by sla.build_cache, mapped read-only
+// so that it loads without copying and all processes using it share the
+// same pages of the OS page cache. The file is a Header followed by the
+// nodes as native doubles.
+
+class Table_file {
+public:
+
+    struct Header {
+        char    magic[8]; // MAGIC
+        int32_t version;  // VERSION
+        int32_t ndata;    // Earth_table::NDATA
+        double  check;    // 1, to catch files of the wrong byte order
+        double  t0, step; // TDB of first node, node spacing, days
+        int64_t nnodes;   // number of nodes
+    };
+
+    // Bumped whenever the meaning of the nodes changes
+    static const int32_t VERSION = 1;
+    static const char MAGIC[8];
+
+    // Maps file fname, returning NULL and the reason in error on failure
+    static Table_file *open(const std::string& fname, std::string& error);
+
+    // Writes a table to fname, via a temporary file renamed into place so
+    // that processes reading it never see a partial file. Returns false
+    // and the reason in error on failure.
+    static bool write(const std::string& fname, const Earth_table& etab, std::string& error);
+
+    ~Table_file(){
+        munmap(map, len);
+    }
+
+    double t0, step;
+    npy_intp nnodes;
+    const double *nodes;
+
+private:
+    Table_file(void *map, size_t len) : map(map), len(len) {}
+    void *map;
+    size_t len;
+};
+
+const char Table_file::MAGIC[8] = {'T', 'R', 'M', 'S', 'L', 'A', 'E', 'T'};
+
+Table_file *Table_file::open(const std::string& fname, std::string& error)
+{
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0){
+        error = "could not open " + fname;
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) || size_t(st.st_size) < sizeof(Header)){
+        ::close(fd);
+        error = fname + " is too short to be a table file";
+        return NULL;
+    }
+
+    size_t len = st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED){
+        error = "could not map " + fname;
+        return NULL;
+    }
+
+    const Header *head = (const Header*)map;
+    if(std::memcmp(head->magic, MAGIC, 8) || head->check != 1.){
+        error = fname + " is not a table file for this machine";
+    }else if(head->version != VERSION || head->ndata != Earth_table::NDATA){
+        error = fname + " was written by a different version of sla; rebuild it";
+    }else if(head->nnodes < 4 || len != sizeof(Header) + sizeof(double)*head->ndata*head->nnodes){
+        error = fname + " has the wrong length";
+    }else{
+        Table_file *file = new Table_file(map, len);
+        file->t0     = head->t0;
+        file->step   = head->step;
+        file->nnodes = head->nnodes;
+        file->nodes  = (const double*)(head+1);
+        return file;
+    }
+    munmap(map, len);
+    return NULL;
+}
+
+bool Table_file::write(const std::string& fname, const Earth_table& etab, std::string& error)
+{
+    Header head;
+    std::memcpy(head.magic, MAGIC, 8);
+    head.version = VERSION;
+    head.ndata   = Earth_table::NDATA;
+    head.check   = 1.;
+    head.t0      = etab.start();
+    head.step    = etab.spacing();
+    head.nnodes  = etab.size();
+
+    std::string tmp = fname + ".tmp" + Subs::str(getpid());
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if(fp == NULL){
+        error = "could not open " + tmp + " for writing";
+        return false;
+    }
+    size_t ndata = size_t(Earth_table::NDATA)*etab.size();
+    bool ok = fwrite(&head, sizeof(Header), 1, fp) == 1 &&
+        fwrite(etab.nodes(), sizeof(double), ndata, fp) == ndata;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), fname.c_str())){
+        std::remove(tmp.c_str());
+        error = "failed to write " + fname;
+        return false;
+    }
+    return true;
+}
+
+Earth_table::Earth_table(std::shared_ptr<const Table_file> file_, npy_intp i0, npy_intp n) :
+    t0(file_->t0 + file_->step*i0), step(file_->step), nnodes(n), file(file_),
+    data(file_->nodes + NDATA*i0) {}
+
+// The table file in use, if any, set by sla.load_cache or the environment
+// variable TRM_SLA_CACHE. The lock is needed as it is read without the GIL.
+
+struct File_cache {
+    std::mutex lock;
+    std::shared_ptr<const Table_file> file;
+
+    std::shared_ptr<const Table_file> get(){
+        std::lock_guard<std::mutex> guard(lock);
+        return file;
+    }
+};
+
+// Returns a new Earth_table covering TDBs t1 to t2 with the default step:
+// a view of the cached table file if that covers the range, otherwise built
+// in nthreads threads. Can be called without the GIL.
+
+static Earth_table*
+new_earth_table(File_cache& cache, double t1, double t2, int nthreads)
+{
+    std::shared_ptr<const Table_file> file = cache.get();
+
+    const double STEP = Earth_table::STEP;
+    if(file && file->step == STEP){
+        // the first node needed, counted from the first of the file
+        double x  = std::floor(t1/STEP) - 1. - file->t0/STEP;
+        npy_intp i0 = npy_intp(std::floor(x + 0.5));
+        npy_intp n  = Earth_table::nnode(t1, t2, STEP);
+        if(std::fabs(x - i0) < 1.e-6 && i0 >= 0 && i0 + n <= file->nnodes)
+            return new Earth_table(file, i0, n);
+    }
+    return new Earth_table(t1, t2, STEP, nthreads);
+}
+
+// Maps fname as the table file of cache, returning false and the reason in
+// error on failure
+
+static bool
+load_table_file(File_cache& cache, const std::string& fname, std::string& error)
+{
+    Table_file *file = Table_file::open(fname, error);
+    if(file == NULL) return false;
+
+    std::lock_guard<std::mutex> guard(cache.lock);
+    cache.file.reset(file);
+    return true;
+}
+
+// Scalar product of two 3-vectors
+
+static inline double
+dot3(const double a[3], const double b[3])
+{
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+// Position and velocity of the observatory on the BCRS reference frame at
+// a given utc, in metres and m/s relative to the helio- and barycentres,
+// along with the times that do not depend upon the target.
+
+struct Observer_state {
+    double utc, tt, tdb, nepoch;
+    double hpos[3], bpos[3], hvel[3], bvel[3];
+};
+
+// Computes the target-independent part of utc2tdb for a single utc. This
+// does not touch any Python objects so can be called with the GIL
+// released. If etab is not NULL, the Earth's position, velocity,
+// precession-nutation matrix and equation of the equinoxes are interpolated
+// from it rather than computed directly.
+
+static void
+observer_state(double utc, const Site& site, const Earth_table *etab, Observer_state& obs)
+{
+
+    obs.utc = utc;
+    PROFILE_CALL(ST_DTT, obs.tt = utc + slaDtt(utc)/Constants::DAY);
+    if(etab){
+        PROFILE_CALL(ST_RCC, 
+                     obs.tdb = obs.tt + etab->rcc(obs.tt, utc-int(utc), -site.longr, site.u, site.v)/Constants::DAY);
+    }else{
+        PROFILE_CALL(ST_RCC, 
+                     obs.tdb = obs.tt + slaRcc(obs.tt, utc-int(utc), -site.longr, site.u, site.v)/Constants::DAY);
+    }
+
+    // Compute position of Earth relative to the centre of the Sun and
+    // the barycentre
+    double rnpb[3][3], eqeqx;
+    if(etab){
+        PROFILE_CALL(ST_ETAB, etab->eval(obs.tdb, obs.hpos, obs.hvel, obs.bpos, obs.bvel, rnpb, eqeqx));
+    }else{
+        PROFILE_CALL(ST_EPHEM, slaEpv(obs.tdb, obs.hpos, obs.hvel, obs.bpos, obs.bvel));
+        PROFILE_CALL(ST_NUTATION, slaPneqx(obs.tdb, rnpb); eqeqx = slaEqeqx(obs.tdb));
+    }
+
+    PROFILE(ST_OBSERVER);
+
+    // Calculate correction from centre of Earth to observatory
+    double last = slaGmst(obs.tdb) + site.longr + eqeqx;
+    double pv[6];
+    slaPvobs(site.latr, site.height, last, pv);
+
+    // Correct for precession/nutation
+    slaDimxv(rnpb, pv, pv);
+    slaDimxv(rnpb, pv+3, pv+3);
+
+    // heliocentric and barycentric, converted to metres and m/s
+    for(int i=0; i<3; i++){
+        obs.hpos[i] = (obs.hpos[i] + pv[i])*Constants::AU;
+        obs.hvel[i] = (obs.hvel[i] + Constants::DAY*pv[i+3])*(Constants::AU/Constants::DAY);
+        obs.bpos[i] = (obs.bpos[i] + pv[i])*Constants::AU;
+        obs.bvel[i] = (obs.bvel[i] + Constants::DAY*pv[i+3])*(Constants::AU/Constants::DAY);
+    }
+
+    obs.nepoch = slaEpj(utc);
+}
+
+// Completes the utc2tdb computation for a single target given the
+// observatory's state. The target position is updated using space motion
+// data, always starting from the catalogue position so that each utc is
+// independent of any other. Only the results selected by want are computed;
+// the others are set to NaN.
+
+static void
+utc2tdb_star(const Observer_state& obs, const Star& star, Tdb_result& res,
+             unsigned want=ALL_OUTPUTS)
+{
+    PROFILE(ST_TARGET);
+
+    // Compute unit vector towards the target
+    double tv[3];
+    star_direction(star, obs.nepoch, tv);
+    double norm = sqrt(tv[0]*tv[0] + tv[1]*tv[1] + tv[2]*tv[2]);
+    for(int i=0; i<3; i++) tv[i] /= norm;
+
+    // Finally, the helio- and barycentrically corrected times
+    double hcorr = (want & (8|16)) ? dot3(tv, obs.hpos)/Constants::C/Constants::DAY : NAN;
+    double bcorr = (want & 4) ? dot3(tv, obs.bpos)/Constants::C/Constants::DAY : NAN;
+
+    res.tt    = obs.tt;
+    res.tdb   = obs.tdb;
+    res.btdb  = obs.tdb + bcorr;
+    res.htdb  = obs.tdb + hcorr;
+    res.hutc  = obs.utc + hcorr;
+
+    // and the radial velocities
+    res.vhel = (want & 32) ? -dot3(tv, obs.hvel)/1000. : NAN;
+    res.vbar = (want & 64) ? -dot3(tv, obs.bvel)/1000. : NAN;
+}
+
+// The targets of utc2tdb_batch in structure-of-arrays form for tdb_kernel
+
+struct Star_soa {
+    std::vector<double> epoch, p0[3], em[3];
+
+    Star_soa(const std::vector<Star>& stars) : epoch(stars.size()) {
+        for(int i=0; i<3; i++){
+            p0[i].resize(stars.size());
+            em[i].resize(stars.size());
+        }
+        for(size_t j=0; j<stars.size(); j++){
+            epoch[j] = stars[j].epoch;
+            for(int i=0; i<3; i++){
+                p0[i][j] = stars[j].p0[i];
+                em[i][j] = stars[j].em[i];
+            }
+        }
+    }
+};
+
+// The target-dependent part of utc2tdb_star for targets j1 to j2-1 of soa:
+// the light travel times to the helio- and barycentres (days) and the
+// radial velocities (km/s), stored from element 0 of hcorr etc. As for
+// utc2tdb_star, only those needed for the outputs selected by want are
+// computed, the others being left untouched. The arithmetic is that of
+// utc2tdb_star, arranged so that the loop vectorises
+// (#pragma omp simd, see setup.py) and, via SLA_CLONES, is compiled for
+// several instruction sets with the best chosen at run time. Compiling
+// without contraction into fused multiply-adds keeps the results identical
+// to those of utc2tdb_star whichever version runs.
+
+SLA_CLONES static void
+tdb_kernel(const Star_soa& soa, npy_intp j1, npy_intp j2, const Observer_state& obs,
+           unsigned want, double *hcorr, double *bcorr, double *vhel, double *vbar)
+{
+    const bool dohc = want & (8|16), dobc = want & 4, dovh = want & 32, dovb = want & 64;
+    const double *epoch = &soa.epoch[j1];
+    const double *p0x = &soa.p0[0][j1], *p0y = &soa.p0[1][j1], *p0z = &soa.p0[2][j1];
+    const double *emx = &soa.em[0][j1], *emy = &soa.em[1][j1], *emz = &soa.em[2][j1];
+    const double *hp = obs.hpos, *bp = obs.bpos, *hv = obs.hvel, *bv = obs.bvel;
+    const double nepoch = obs.nepoch;
+    const npy_intp n = j2 - j1;
+
+#pragma omp simd
+    for(npy_intp j=0; j<n; j++){
+        double t = nepoch - epoch[j];
+        double x = p0x[j] + t*emx[j];
+        double y = p0y[j] + t*emy[j];
+        double z = p0z[j] + t*emz[j];
+        double norm = sqrt(x*x + y*y + z*z);
+        x /= norm;
+        y /= norm;
+        z /= norm;
+        if(dohc) hcorr[j] = (x*hp[0] + y*hp[1] + z*hp[2])/Constants::C/Constants::DAY;
+        if(dobc) bcorr[j] = (x*bp[0] + y*bp[1] + z*bp[2])/Constants::C/Constants::DAY;
+        if(dovh) vhel[j]  = -(x*hv[0] + y*hv[1] + z*hv[2])/1000.;
+        if(dovb) vbar[j]  = -(x*bv[0] + y*bv[1] + z*bv[2])/1000.;
+    }
+}
+
+// Carries out the utc2tdb computation for a single utc.
+
+static void
+utc2tdb_point(double utc, const Site& site, const Star& star, const Earth_table *etab,
+              Tdb_result& res)
+{
+    Observer_state obs;
+    observer_state(utc, site, etab, obs);
+    utc2tdb_star(obs, star, res);
+}
+
+// A small cache of slaAoppa results keyed on everything that slaAoppa
+// takes other than the date. The refraction constants from
+// slaRefco, which dominate its cost, depend only on these, as does all of
+// aoprms except for the equation of the equinoxes folded into element 12
+// (and the sidereal time derived from it by slaAoppat), which is corrected
+// for the change in date. Repeated calls with the same site, Earth
+// orientation and weather, e.g. one per frame, thus avoid slaRefco.
+
+struct Aoppa_cache {
+    static const int NKEY = 11, NCACHE = 16;
+    struct Entry {
+        double key[NKEY];
+        double eqeqx; // slaEqeqx at the date aoprms was computed
+        double aoprms[14];
+    };
+    Entry entries[NCACHE];
+    int nused = 0, next = 0;
+    std::mutex lock;
+};
+
+// Equivalent to slaAoppa, using cache unless it is NULL
+
+static void
+aoppa(Aoppa_cache *cache, double utc, const Site& site, const Atmosphere& atmos, double aoprms[14])
+{
+    if(cache == NULL){
+        slaAoppa(utc, site.dut, site.longr, site.latr, site.height, site.xp, site.yp, 
+                 atmos.T, atmos.P, atmos.rh, atmos.wave, atmos.tlr, aoprms);
+        return;
+    }
+
+    const int NKEY = Aoppa_cache::NKEY, NCACHE = Aoppa_cache::NCACHE;
+    const double key[NKEY] = {site.longr, site.latr, site.height, site.dut, site.xp, site.yp,
+                              atmos.T, atmos.P, atmos.rh, atmos.wave, atmos.tlr};
+    double eqeqx = NAN;
+    {
+        std::lock_guard<std::mutex> guard(cache->lock);
+        for(int i=0; i<cache->nused; i++){
+            const Aoppa_cache::Entry& entry = cache->entries[i];
+            if(std::equal(key, key+NKEY, entry.key)){
+                std::copy(entry.aoprms, entry.aoprms+14, aoprms);
+                eqeqx = entry.eqeqx;
+                break;
+            }
+        }
+    }
+
+    if(eqeqx == eqeqx){
+        aoprms[12] += slaEqeqx(utc) - eqeqx;
+        slaAoppat(utc, aoprms);
+        return;
+    }
+
+    slaAoppa(utc, site.dut, site.longr, site.latr, site.height, site.xp, site.yp, 
+             atmos.T, atmos.P, atmos.rh, atmos.wave, atmos.tlr, aoprms);
+    eqeqx = slaEqeqx(utc);
+
+    std::lock_guard<std::mutex> guard(cache->lock);
+    Aoppa_cache::Entry& entry = cache->entries[cache->next];
+    std::copy(key, key+NKEY, entry.key);
+    std::copy(aoprms, aoprms+14, entry.aoprms);
+    entry.eqeqx = eqeqx;
+    cache->next  = (cache->next + 1) % NCACHE;
+    cache->nused = std::max(cache->nused, cache->next == 0 ? NCACHE : cache->next);
+}
+
+// Holds the star-independent parameters needed to convert mean to observed
+// places. The expensive parts (slaMappa and aoppa, which includes a full
+// calculation of the refraction constants unless cached) are re-computed
+// only when the utc moves by more than REFRESH days from that at which they
+// were last computed; otherwise only the sidereal time is updated
+// (slaAoppat). Over REFRESH, the neglected changes in aberration,
+// precession and nutation are below 0.02 arcsec. cache is passed to aoppa.
+
+class Apparent {
+public:
+
+    // Maximum utc change before a full re-computation, days
+    static const double REFRESH;
+
+    Apparent(const Site& site, const Atmosphere& atmos, Aoppa_cache *cache) : 
+        site(site), atmos(atmos), cache(cache), utc0(0.), set(false) {}
+
+    // Makes the parameters valid for utc
+    void update(double utc);
+
+    // Forces a full re-computation at the next update, needed if the site
+    // or atmosphere change
+    void reset(){
+        set = false;
+    }
+
+    // Mean-to-apparent and apparent-to-observed parameters
+    double amprms[21], aoprms[14];
+
+private:
+    const Site& site;
+    const Atmosphere& atmos;
+    Aoppa_cache *cache;
+    double utc0;
+    bool set;
+};
+
+const double Apparent::REFRESH = 1./24.;
+
+void Apparent::update(double utc)
+{
+    if(set && std::fabs(utc-utc0) <= REFRESH){
+        slaAoppat(utc, aoprms);
+    }else{
+        double tt = utc + slaDtt(utc)/Constants::DAY;
+        PROFILE_CALL(ST_MAPPA, slaMappa(2000., tt, amprms));
+        PROFILE_CALL(ST_AOPPA, aoppa(cache, utc, site, atmos, aoprms));
+        utc0 = utc;
+        set  = true;
+    }
+}
+
+// Carries out the amass computation for a single target given the epoch
+// (Julian years) corresponding to the utc at which app has been updated.
+// The airmass, pa and delz are only computed if selected by want, otherwise
+// they are set to NaN.
+
+static void
+amass_star(double nepoch, const Site& site, const Star& star, const Atmosphere& atmos,
+           const Apparent& app, Amass_result& res, unsigned want=ALL_OUTPUTS)
+{
+    PROFILE(ST_APPARENT);
+    const double CFAC = Constants::PI/180.;
+
+    // correct for space motion
+    double p[3], rar, decr;
+    star_direction(star, nepoch, p);
+    slaDcc2s(p, &rar, &decr);
+    rar = slaDranrm(rar);
+
+    // geocentric apparent place
+    double rap, dap;
+    slaMapqkz(rar, decr, const_cast<double*>(app.amprms), &rap, &dap);
+
+    // *observed* azimuth (N->E), zenith distance, hour angle, declination, ra (all radians)
+    double zdob, decob, raob;
+    slaAopqk(rap, dap, const_cast<double*>(app.aoprms), &res.az, &zdob, &res.ha, &decob, &raob);
+
+    // compute refraction
+    if(want & 32){
+        double tanz = tan(zdob);
+        res.delz = tanz*(atmos.refa + atmos.refb*tanz*tanz)/CFAC;
+    }else{
+        res.delz = NAN;
+    }
+
+    // convert units
+    res.alt     = 90.-zdob/CFAC;
+    res.airmass = (want & 1) ? slaAirmas(zdob) : NAN; 
+    res.az     /= CFAC;
+
+    // Compute pa
+    if(want & 16){
+        res.pa = slaPa(res.ha,decr,site.latr)/CFAC;
+        res.pa = res.pa > 0. ? res.pa : 360.+res.pa;
+    }else{
+        res.pa = NAN;
+    }
+
+    res.ha *= 24./Constants::TWOPI;
+}
+
+// Carries out the amass computation for a single utc. app carries the
+// star-independent parameters from one call to the next.
+
+static void
+amass_point(double utc, const Site& site, const Star& star, const Atmosphere& atmos,
+            Apparent& app, Amass_result& res)
+{
+    app.update(utc);
+    amass_star(slaEpj(utc), site, star, atmos, app, res);
+}
+
+// Tabulates slaRefro as a function of observed zenith distance for one site
+// and atmosphere, from 0 to 93 degrees (beyond which slaRefro stops
+// varying) every STEP degrees, for 4-point Lagrange interpolation. The
+// interpolation error is measured at every interval midpoint when the table
+// is built; with the default step it is a few milliarcsec at worst, right
+// at the horizon, and far smaller above it.
+
+class Refro_table {
+public:
+
+    // Node spacing, degrees
+    static const double STEP;
+
+    // Builds the table, splitting the slaRefro calls over nthreads threads
+    Refro_table(const Site& site, const Atmosphere& atmos, int nthreads);
+
+    // Refraction, radians, at observed zenith distance zobs, radians
+    double eval(double zobs) const;
+
+    // True if the table was built for this site and atmosphere
+    bool matches(const Site& site, const Atmosphere& atmos) const {
+        return site.height == height && site.latr == latr && atmos.T == T && atmos.P == P &&
+            atmos.rh == rh && atmos.wave == wave && atmos.tlr == tlr;
+    }
+
+    // Maximum error found at the midpoints, radians
+    double maxerr;
+
+    // Number of intervals from 0 to 93 degrees, and the node step, radians
+    int nint;
+    double step;
+
+    // Refraction at nodes -1 to nint+1
+    std::vector<double> ref;
+
+private:
+    double height, latr, T, P, rh, wave, tlr;
+
+    // Direct evaluation
+    double refro(double zobs) const {
+        double r;
+        slaRefro(zobs, height, T, P, rh, wave, latr, tlr, 1.e-8, &r);
+        return r;
+    }
+};
+
+const double Refro_table::STEP = 0.05;
+
+Refro_table::Refro_table(const Site& site, const Atmosphere& atmos, int nthreads) :
+    maxerr(0.), nint(int(std::floor(93./STEP+0.5))), step(Constants::PI/180.*STEP), ref(nint+3),
+    height(site.height), latr(site.latr), T(atmos.T), P(atmos.P), rh(atmos.rh), 
+    wave(atmos.wave), tlr(atmos.tlr)
+{
+    parallel_for(nint+3, nthreads, [this](npy_intp i1, npy_intp i2){
+            for(npy_intp i=i1; i<i2; i++)
+                ref[i] = refro(step*(i-1));
+        });
+
+    std::vector<double> err(nint);
+    parallel_for(nint, nthreads, [&](npy_intp i1, npy_intp i2){
+            for(npy_intp i=i1; i<i2; i++){
+                double z = step*(i+0.5);
+                err[i] = std::fabs(eval(z) - refro(z));
+            }
+        });
+    for(int i=0; i<nint; i++)
+        maxerr = std::max(maxerr, err[i]);
+}
+
+double Refro_table::eval(double zobs) const
+{
+    double x = zobs/step;
+    if(!(x >= 0. && x <= nint)) return refro(zobs);
+    int k = std::min(int(x), nint-1);
+    double s = x - k;
+
+    // Lagrange weights for nodes k-1 to k+2, stored at k to k+3
+    const double *r = &ref[k];
+    double sm1 = s-1., sm2 = s-2., sp1 = s+1.;
+    return -s*sm1*sm2/6.*r[0] + sp1*sm1*sm2/2.*r[1] - sp1*s*sm2/2.*r[2] + sp1*s*sm1/6.*r[3];
+}
+
+// The last Refro_table built
+
+struct Refro_cache {
+    std::mutex lock;
+    std::shared_ptr<const Refro_table> table;
+};
+
+// Returns a table for site and atmosphere, re-using the one in cache if
+// possible. Must be called with the GIL held (it is released while the
+// table is built); the table returned stays valid while the caller holds
+// the pointer even if the cache moves on.
+
+static std::shared_ptr<const Refro_table>
+get_refro_table(Refro_cache& cache, const Site& site, const Atmosphere& atmos, int nthreads)
+{
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        if(cache.table && cache.table->matches(site, atmos))
+            return cache.table;
+    }
+
+    std::shared_ptr<const Refro_table> tab;
+    Py_BEGIN_ALLOW_THREADS
+    tab.reset(new Refro_table(site, atmos, nthreads));
+    Py_END_ALLOW_THREADS
+
+    std::lock_guard<std::mutex> guard(cache.lock);
+    cache.table = tab;
+    return tab;
+}
+
+// The caches of intermediate results kept between calls. There is one per
+// module object, in its state, so that sub-interpreters do not share them.
+
+struct Caches {
+    File_cache  file;
+    Aoppa_cache aoppa;
+    Refro_cache refro;
+};
+
+// The state of each module object: its caches and types
+
+struct Module_state {
+    Caches *caches;
+    PyTypeObject *target_type;
+    PyTypeObject *observatory_type;
+};
+
+// Returns the state of module m, which must be this module
+
+static inline Module_state*
+module_state(PyObject *m)
+{
+    return (Module_state*) PyModule_GetState(m);
+}
+
+// Returns the state of the module which defined type or one of its bases,
+// or NULL with an exception set if there is none. Defined with the module.
+
+static Module_state*
+type_state(PyTypeObject *type);
+
+// Carries out the sun computation for a single utc. If etab is not NULL,
+// the Earth's heliocentric position, the precession-nutation matrix and
+// the equation of the equinoxes are interpolated from it (at TT rather than
+// TDB, a negligible difference) instead of being computed with slaEvp,
+// slaNut and slaEqeqx. The two routes use different models of the Earth's
+// orbit and precession-nutation, but agree to well under an arcsecond. If
+// fast is false and rtab is not NULL, slaRefro is interpolated from it.
+
+static void
+sun_point(double utc, const Site& site, const Atmosphere& atmos, bool fast, 
+          const Earth_table *etab, const Refro_table *rtab, Sun_result& res)
+{
+    const double CFAC = Constants::PI/180.;
+
+    // UT1
+    double ut1 = utc + site.dut/Constants::DAY;
+
+    // TT
+    double tt;
+    PROFILE_CALL(ST_DTT, tt = utc + slaDtt(utc)/Constants::DAY);
+
+    // Compute position of Earth relative to the centre of the Sun and
+    // the barycentre, then nutate
+    double ph[3], pb[3], vh[3], vb[3], phn[3], eqeqx;
+    if(etab){
+        double rnpb[3][3];
+        PROFILE_CALL(ST_ETAB, etab->eval(tt, ph, vh, pb, vb, rnpb, eqeqx));
+        slaDmxv(rnpb, ph, phn);
+    }else{
+        PROFILE_CALL(ST_EPHEM, slaEvp(tt, -1., vb, pb, vh, ph));
+        double rmatn[3][3];
+        PROFILE_CALL(ST_NUTATION, slaNut(tt, rmatn); eqeqx = slaEqeqx(tt));
+        slaDmxv(rmatn, ph, phn);
+    }
+
+    // Calculate correction from centre of Earth to observatory
+    double last = slaGmst(ut1) + site.longr + eqeqx;
+    double pv[6];
+    slaPvobs(site.latr, site.height, last, pv);
+
+    double sun[3];
+    for(int i=0; i<3; i++)
+	sun[i] = -phn[i]-pv[i];
+
+    double ra, dec, az, el;
+    slaDcc2s(sun, &ra, &dec);
+    slaDe2h(last-ra, dec, site.latr, &az, &el);
+    double refract=0.;
+
+    PROFILE(ST_REFRACTION);
+    if(fast){
+	double zobs;
+	slaRefz(Constants::PI/2.-el, atmos.refa, atmos.refb, &zobs);
+	refract = Constants::PI/2.-el - zobs;
+    }else{
+	// iterate to the observed zenith distance, stopping once the
+	// refraction changes by less than 1e-10 radians
+	const int MAXITER = 10;
+	for(int i=0; i<MAXITER; i++){
+	    double zd = Constants::PI/2.-el-refract, last = refract;
+	    if(rtab){
+		refract = rtab->eval(zd);
+	    }else{
+		slaRefro(zd, site.height, atmos.T, atmos.P, atmos.rh, atmos.wave, site.latr, 
+			 atmos.tlr, 1.e-8, &refract);
+	    }
+	    if(std::fabs(refract-last) < 1.e-10) break;
+	}
+    }
+
+    res.az      = az/CFAC;
+    res.el      = (el+refract)/CFAC;
+    res.refract = refract/CFAC;
+    res.ra      = 12.*ra/Constants::PI;
+    res.dec     = dec/CFAC;
+}
+
+// Finds a root of func(x) between x1 and x2 to within acc using the
+// Illinois variant of regula falsi, which avoids the one-sided convergence
+// of the plain method. Returns NaN if func(x1) and func(x2) do not have
+// opposite signs.
+
+template <class Func>
+static double
+illinois(Func func, double x1, double x2, double acc)
+{
+    const int MAXITER = 100;
+
+    double f1 = func(x1), f2 = func(x2);
+    if(f1 == 0.) return x1;
+    if(f2 == 0.) return x2;
+    if(!((f1 < 0. && f2 > 0.) || (f1 > 0. && f2 < 0.))) return NAN;
+
+    double x = x1;
+    int side = 0;
+    for(int i=0; i<MAXITER && std::fabs(x2-x1) > acc; i++){
+        x = (f2*x1 - f1*x2)/(f2 - f1);
+        double f = func(x);
+        if(f == 0.) break;
+        if((f > 0.) == (f2 > 0.)){
+            x2 = x;
+            f2 = f;
+            if(side == -1) f1 /= 2.;
+            side = -1;
+        }else{
+            x1 = x;
+            f1 = f;
+            if(side == +1) f2 /= 2.;
+            side = +1;
+        }
+    }
+    return x;
+}
+
+// Finds when the Sun is at elevation elev (degrees) between utc1 and utc2
+// to within acc days, using etab and rtab as for sun_point. Returns NaN if
+// the times do not bracket the elevation.
+
+static double
+sun_root_point(double utc1, double utc2, double elev, const Site& site, const Atmosphere& atmos,
+               bool fast, const Earth_table *etab, const Refro_table *rtab, double acc)
+{
+    return illinois([&](double utc){
+            Sun_result res;
+            sun_point(utc, site, atmos, fast, etab, rtab, res);
+            return res.el - elev;
+        }, utc1, utc2, acc);
+}
+
+// Finds the range of TDB t1 to t2 an Earth_table must cover for the finite
+// utcs of narr arrays, returning false with an exception set if this is too
+// large. TDB exceeds UTC by less than 0.01 days.
+
+static bool
+table_range(const std::string& name, int narr, const Array_input *utcs, double& t1, double& t2)
+{
+    bool first = true;
+    double umin = 0., umax = 0.;
+    for(int n=0; n<narr; n++){
+        for(npy_intp i=0; i<utcs[n].size(); i++){
+            double u = utcs[n][i];
+            if(std::isfinite(u)){
+                if(first){
+                    umin = umax = u;
+                    first = false;
+                }else if(u < umin){
+                    umin = u;
+                }else if(u > umax){
+                    umax = u;
+                }
+            }
+        }
+    }
+    t1 = umin;
+    t2 = umax + 0.01;
+    if(Earth_table::nnode(t1, t2, Earth_table::STEP) > Earth_table::MAXNODE){
+        PyErr_SetString(PyExc_ValueError, (name + ": range of utc too large for mode='interp'").c_str());
+        return false;
+    }
+    return true;
+}
+
+// Checks that an array supplied via an out= argument can be written to
+// directly with the given shape and type.
+
+static bool
+check_output(PyObject *obj, int nd, const npy_intp *dims, int type)
+{
+    if(!PyArray_Check(obj)) return false;
+    PyArrayObject *arr = (PyArrayObject*)obj;
+    if(PyArray_TYPE(arr) != type || !PyArray_ISCARRAY(arr) ||
+       !PyArray_ISNOTSWAPPED(arr) || PyArray_NDIM(arr) != nd)
+        return false;
+    for(int i=0; i<nd; i++)
+        if(PyArray_DIM(arr,i) != dims[i]) return false;
+    return true;
+}
+
+// Sets up elements i1 to i2-1 of the nout output arrays of a calculation,
+// all of shape dims and of the given type (float64 unless stated). If out
+// is NULL or None, new arrays are allocated. Otherwise out must be a
+// sequence of nout writeable, C-contiguous, native arrays of that type (a 2D
+// array, whose rows are used, is fine) which are then written to directly,
+// avoiding any allocation. New references are returned in arrs. On failure,
+// false is returned with an exception set and no references held for
+// elements i1 to i2-1.
+
+static bool
+get_outputs(const std::string& name, PyObject *out, int nout, int i1, int i2,
+            int nd, npy_intp *dims, PyArrayObject **arrs, int type=NPY_DOUBLE)
+{
+    if(out == NULL || out == Py_None){
+        for(int i=i1; i<i2; i++){
+            arrs[i] = (PyArrayObject*) PyArray_SimpleNew(nd, dims, type);
+            if(arrs[i] == NULL){
+                for(int j=i1; j<i; j++)
+                    Py_DECREF(arrs[j]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    PyObject *seq = PySequence_Fast(out, (name + ": out must be a sequence of arrays").c_str());
+    if(seq == NULL) return false;
+
+    if(PySequence_Fast_GET_SIZE(seq) != nout){
+        PyErr_SetString(PyExc_ValueError, (name + ": out must contain " + Subs::str(nout) +
+                                           " arrays").c_str());
+        Py_DECREF(seq);
+        return false;
+    }
+
+    for(int i=i1; i<i2; i++){
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        if(!check_output(item, nd, dims, type)){
+            PyErr_SetString(PyExc_ValueError, (name + ": out array " + Subs::str(i) +
+                                               " is not a writeable, C-contiguous, native " +
+                                               (type == NPY_FLOAT ? "float32" : "float64") +
+                                               " array of the right shape").c_str());
+            for(int j=i1; j<i; j++)
+                Py_DECREF(arrs[j]);
+            Py_DECREF(seq);
+            return false;
+        }
+        Py_INCREF(item);
+        arrs[i] = (PyArrayObject*)item;
+    }
+    Py_DECREF(seq);
+    return true;
+}
+
+// Releases n output arrays after a failure
+
+static void
+release_outputs(int n, PyArrayObject **arrs)
+{
+    for(int i=0; i<n; i++)
+        Py_DECREF(arrs[i]);
+}
+
+// Interprets the outputs argument of utc2tdb and amass, which selects a
+// subset of the nname possible results. NULL or None means all of them in
+// the usual order; otherwise it should be a name or a sequence of names.
+// The indexes of the selected results are returned in sel, in the order
+// given, and want gets the corresponding mask.
+
+static bool
+set_outputs(const std::string& name, PyObject *outputs, int nname, const char **names,
+            std::vector<int>& sel, unsigned& want)
+{
+    sel.clear();
+    want = 0;
+    if(outputs == NULL || outputs == Py_None){
+        for(int k=0; k<nname; k++)
+            sel.push_back(k);
+        want = ALL_OUTPUTS;
+        return true;
+    }
+
+    PyObject *seq;
+    if(PyUnicode_Check(outputs)){
+        seq = PyTuple_Pack(1, outputs);
+    }else{
+        seq = PySequence_Fast(outputs, (name + ": outputs must be a name or a sequence of names").c_str());
+    }
+    if(seq == NULL) return false;
+
+    bool ok = PySequence_Fast_GET_SIZE(seq) > 0;
+    if(!ok)
+        PyErr_SetString(PyExc_ValueError, (name + ": no outputs selected").c_str());
+
+    for(Py_ssize_t i=0; ok && i<PySequence_Fast_GET_SIZE(seq); i++){
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        const char *oname = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+        int k = 0;
+        while(oname && k < nname && strcmp(oname, names[k]) != 0) k++;
+        if(oname == NULL || k == nname){
+            std::string valid;
+            for(int j=0; j<nname; j++)
+                valid += (j ? ", " : "") + std::string(names[j]);
+            PyErr_SetString(PyExc_ValueError, (name + ": outputs must be chosen from " + valid).c_str());
+            ok = false;
+        }else{
+            sel.push_back(k);
+            want |= 1u << k;
+        }
+    }
+    Py_DECREF(seq);
+    return ok;
+}
+
+// Interprets the dtype argument of utc2tdb and amass, which can be None
+// or anything numpy understands as float64 or float32. single is set true
+// for float32.
+
+static bool
+set_dtype(const std::string& name, PyObject *dtype, bool& single)
+{
+    single = false;
+    if(dtype == NULL || dtype == Py_None) return true;
+
+    PyArray_Descr *descr;
+    if(!PyArray_DescrConverter(dtype, &descr)) return false;
+    int type = descr->type_num;
+    Py_DECREF(descr);
+    if(type != NPY_DOUBLE && type != NPY_FLOAT){
+        PyErr_SetString(PyExc_ValueError, (name + ": dtype must be float64 or float32").c_str());
+        return false;
+    }
+    single = type == NPY_FLOAT;
+    return true;
+}
+
+// Data pointer of an output array of type float64 or float32
+
+struct Out_ptr {
+    void *data;
+    bool single;
+
+    void set(npy_intp k, double v) const {
+        if(single)
+            ((float*)data)[k] = float(v);
+        else
+            ((double*)data)[k] = v;
+    }
+};
+
+// Sets up the selected output arrays of a calculation via get_outputs.
+// Output k has nds[k] dimensions, the last nds[k] of the ndim dims. It is
+// float32 if single is true and time[k] is false, otherwise float64. out,
+// if given, must hold one array per selected output. The data pointers are
+// returned in ptrs.
+
+static bool
+select_outputs(const std::string& name, PyObject *out, const std::vector<int>& sel,
+               const int *nds, const bool *time, bool single, int ndim, npy_intp *dims,
+               PyArrayObject **arrs, Out_ptr *ptrs)
+{
+    int nsel = sel.size();
+    for(int i=0; i<nsel; i++){
+        int nd = nds[sel[i]];
+        ptrs[i].single = single && !time[sel[i]];
+        if(!get_outputs(name, out, nsel, i, i+1, nd, dims+ndim-nd, arrs,
+                        ptrs[i].single ? NPY_FLOAT : NPY_DOUBLE)){
+            release_outputs(i, arrs);
+            return false;
+        }
+        ptrs[i].data = PyArray_DATA(arrs[i]);
+    }
+    return true;
+}
+
+// Returns a tuple of the selected outputs, stealing the references
+
+static PyObject*
+output_tuple(const std::vector<int>& sel, PyArrayObject **arrs)
+{
+    PyObject *tuple = PyTuple_New(sel.size());
+    if(tuple == NULL){
+        release_outputs(sel.size(), arrs);
+        return NULL;
+    }
+    for(size_t i=0; i<sel.size(); i++)
+        PyTuple_SET_ITEM(tuple, i, (PyObject*)arrs[i]);
+    return tuple;
+}
+
+// Returns a tuple of the selected values of a scalar calculation
+
+static PyObject*
+value_tuple(const std::vector<int>& sel, const double *vals)
+{
+    PyObject *tuple = PyTuple_New(sel.size());
+    if(tuple == NULL) return NULL;
+    for(size_t i=0; i<sel.size(); i++){
+        PyObject *v = PyFloat_FromDouble(vals[sel[i]]);
+        if(v == NULL){
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, i, v);
+    }
+    return tuple;
+}
+
+// Checks that out= has not been supplied for a scalar calculation
+
+static bool
+check_no_out(const std::string& name, PyObject *out)
+{
+    if(out != NULL && out != Py_None){
+        PyErr_SetString(PyExc_ValueError, (name + ": out can only be used with an array of utc").c_str());
+        return false;
+    }
+    return true;
+}
+
+// The following routines carry out the calculations of utc2tdb, amass and
+// sun once their arguments have been checked. They are shared by the module
+// functions and the methods of the Observatory class.
+
+static PyObject*
+utc2tdb_compute(Caches& caches, PyObject *iutc, const Site& site, const Star& star, int nthreads,
+                bool interp, PyObject *outputs, bool single, PyObject *out)
+{
+    PROFILE(ST_UTC2TDB);
+    bool scalar;
+    double vutc;
+    if(!check_utc("sla.utc2tdb", iutc, scalar, vutc))
+        return NULL;
+
+    std::vector<int> sel;
+    unsigned want;
+    if(!set_outputs("sla.utc2tdb", outputs, NTDB, TDB_OUTPUTS, sel, want))
+        return NULL;
+
+    if(scalar){
+
+        if(!check_no_out("sla.utc2tdb", out))
+            return NULL;
+
+        Tdb_result res;
+        utc2tdb_point(vutc, site, star, NULL, res);
+        double vals[NTDB];
+        result_values(res, vals);
+        return value_tuple(sel, vals);
+
+    }else{
+
+        Array_input utc;
+        if(!utc.set(iutc)) return NULL;
+        npy_intp nutc = utc.size();
+
+        // In interpolation mode, find the range of utc to tabulate over.
+        double t1 = 0., t2 = 0.;
+        if(interp && !table_range("sla.utc2tdb", 1, &utc, t1, t2)){
+            return NULL;
+        }
+
+        npy_intp dim[1] = {nutc};
+        const int nds[NTDB] = {1, 1, 1, 1, 1, 1, 1};
+        PyArrayObject *outs[NTDB];
+        Out_ptr ptrs[NTDB];
+        if(!select_outputs("sla.utc2tdb", out, sel, nds, TDB_TIME, single, 1, dim, outs, ptrs)){
+            return NULL;
+        }
+        const size_t nsel = sel.size();
+
+        // Each utc is independent of the others so the array can be split
+        // into chunks which are processed in separate threads. Each thread
+        // carries out exactly the same operations as the serial code.
+        Py_BEGIN_ALLOW_THREADS
+
+        Earth_table *etab = interp ?
+            new_earth_table(caches.file, t1, t2, nthreads) : NULL;
+
+        parallel_for(nutc, nthreads, [&](npy_intp i1, npy_intp i2){
+                Observer_state obs;
+                Tdb_result res;
+                double vals[NTDB];
+                for(npy_intp i=i1; i<i2; i++){
+                    // repeated utcs, as in photon event lists, are computed once
+                    if(i == i1 || utc[i] != utc[i-1]){
+                        observer_state(utc[i], site, etab, obs);
+                        utc2tdb_star(obs, star, res, want);
+                        result_values(res, vals);
+                    }
+                    for(size_t m=0; m<nsel; m++)
+                        ptrs[m].set(i, vals[sel[m]]);
+                }
+            });
+
+        delete etab;
+
+        Py_END_ALLOW_THREADS
+
+        return output_tuple(sel, outs);
+    }
+}
+
+static PyObject*
+amass_compute(Caches& caches, PyObject *iutc, const Site& site, const Star& star,
+              const Atmosphere& atmos, PyObject *outputs, bool single, PyObject *out)
+{
+    PROFILE(ST_AMASS);
+    bool scalar;
+    double vutc;
+    if(!check_utc("sla.amass", iutc, scalar, vutc))
+        return NULL;
+
+    std::vector<int> sel;
+    unsigned want;
+    if(!set_outputs("sla.amass", outputs, NAMASS, AMASS_OUTPUTS, sel, want))
+        return NULL;
+
+    if(scalar){
+
+        if(!check_no_out("sla.amass", out))
+            return NULL;
+
+        // A single utc has been passed and we will return floats.
+        Apparent app(site, atmos, &caches.aoppa);
+        Amass_result res;
+        amass_point(vutc, site, star, atmos, app, res);
+
+        // return  airmass, altitude (deg), azimuth (deg, N=0, E=90),
+        // hour angle, parallactic angle, angle of refraction
+        double vals[NAMASS];
+        result_values(res, vals);
+        return value_tuple(sel, vals);
+
+    }else{
+
+        Array_input utc;
+        if(!utc.set(iutc)) return NULL;
+        npy_intp nutc = utc.size();
+
+        npy_intp dim[1] = {nutc};
+        const int nds[NAMASS] = {1, 1, 1, 1, 1, 1};
+        PyArrayObject *outs[NAMASS];
+        Out_ptr ptrs[NAMASS];
+        if(!select_outputs("sla.amass", out, sel, nds, AMASS_TIME, single, 1, dim, outs, ptrs)){
+            return NULL;
+        }
+        const size_t nsel = sel.size();
+
+        // The star-independent parameters are only re-computed every
+        // Apparent::REFRESH days of utc, so this is much faster if the
+        // utcs are in time order.
+        Apparent app(site, atmos, &caches.aoppa);
+        Amass_result res;
+        double vals[NAMASS];
+        for(npy_intp i=0; i<nutc; i++){
+            app.update(utc[i]);
+            amass_star(slaEpj(utc[i]), site, star, atmos, app, res, want);
+            result_values(res, vals);
+            for(size_t m=0; m<nsel; m++)
+                ptrs[m].set(i, vals[sel[m]]);
+        }
+
+        // return  airmass, altitude (deg), azimuth (deg, N=0, E=90),
+        // hour angle, parallactic angle, angle of refraction
+        return output_tuple(sel, outs);
+    }
+}
+
+static PyObject*
+sun_compute(Caches& caches, PyObject *iutc, const Site& site, const Atmosphere& atmos, bool fast,
+            int nthreads, bool interp, bool rtable, PyObject *out)
+{
+    PROFILE(ST_SUN);
+    bool scalar;
+    double vutc;
+    if(!check_utc("sla.sun", iutc, scalar, vutc))
+        return NULL;
+
+    std::shared_ptr<const Refro_table> rtab;
+    if(rtable && !fast)
+        rtab = get_refro_table(caches.refro, site, atmos, nthreads);
+
+    if(scalar){
+
+        if(!check_no_out("sla.sun", out))
+            return NULL;
+
+        Sun_result res;
+        sun_point(vutc, site, atmos, fast, NULL, rtab.get(), res);
+
+        // return  azimuth and elevation
+        return Py_BuildValue("ddddd", res.az, res.el, res.refract, res.ra, res.dec);
+
+    }else{
+
+        Array_input utc;
+        if(!utc.set(iutc)) return NULL;
+        npy_intp nutc = utc.size();
+
+        double t1 = 0., t2 = 0.;
+        if(interp && !table_range("sla.sun", 1, &utc, t1, t2)){
+            return NULL;
+        }
+
+        npy_intp dim[1] = {nutc};
+        PyArrayObject *outs[5];
+        if(!get_outputs("sla.sun", out, 5, 0, 5, 1, dim, outs)){
+            return NULL;
+        }
+
+        // data pointers
+        double *az      = (double*) PyArray_DATA(outs[0]);
+        double *el      = (double*) PyArray_DATA(outs[1]);
+        double *refract = (double*) PyArray_DATA(outs[2]);
+        double *ra      = (double*) PyArray_DATA(outs[3]);
+        double *dec     = (double*) PyArray_DATA(outs[4]);
+
+        Py_BEGIN_ALLOW_THREADS
+
+        Earth_table *etab = interp ?
+            new_earth_table(caches.file, t1, t2, nthreads) : NULL;
+
+        parallel_for(nutc, nthreads, [&](npy_intp i1, npy_intp i2){
+                Sun_result res;
+                for(npy_intp i=i1; i<i2; i++){
+                    sun_point(utc[i], site, atmos, fast, etab, rtab.get(), res);
+                    az[i]      = res.az;
+                    el[i]      = res.el;
+                    refract[i] = res.refract;
+                    ra[i]      = res.ra;
+                    dec[i]     = res.dec;
+                }
+            });
+
+        delete etab;
+
+        Py_END_ALLOW_THREADS
+
+
+        return Py_BuildValue("NNNNN", outs[0], outs[1], outs[2], outs[3], outs[4]);
+    }
+}
+
+// Computes amass for many targets at a set of utcs, returning 2D arrays of
+// shape (ntarget,ntime). The star-independent parameters are computed once
+// per utc and shared by all targets.
+
+static PyObject*
+amass_batch_compute(Caches& caches, PyObject *iutc, const Site& site,
+                    const std::vector<Star>& stars, const Atmosphere& atmos, int nthreads,
+                    PyObject *outputs, bool single, PyObject *out)
+{
+    PROFILE(ST_AMASS);
+    bool scalar;
+    double vutc;
+    if(!check_utc("sla.amass_batch", iutc, scalar, vutc))
+        return NULL;
+
+    std::vector<int> sel;
+    unsigned want;
+    if(!set_outputs("sla.amass_batch", outputs, NAMASS, AMASS_OUTPUTS, sel, want))
+        return NULL;
+
+    Array_input utc;
+    if(scalar){
+        utc.set(vutc);
+    }else if(!utc.set(iutc)){
+        return NULL;
+    }
+    npy_intp ntime = utc.size();
+    npy_intp ntarg    = stars.size();
+
+    npy_intp dims[2] = {ntarg, ntime};
+    const int nds[NAMASS] = {2, 2, 2, 2, 2, 2};
+    PyArrayObject *outs[NAMASS];
+    Out_ptr ptrs[NAMASS];
+    if(!select_outputs("sla.amass_batch", out, sel, nds, AMASS_TIME, single, 2, dims, outs, ptrs)){
+        return NULL;
+    }
+    const size_t nsel = sel.size();
+
+    // Covers utcs it1 to it2-1 for targets j1 to j2-1
+    auto block = [&](npy_intp it1, npy_intp it2, npy_intp j1, npy_intp j2){
+        Apparent app(site, atmos, &caches.aoppa);
+        Amass_result res;
+        double vals[NAMASS];
+        for(npy_intp i=it1; i<it2; i++){
+            app.update(utc[i]);
+            double nepoch = slaEpj(utc[i]);
+            for(npy_intp j=j1; j<j2; j++){
+                amass_star(nepoch, site, stars[j], atmos, app, res, want);
+                result_values(res, vals);
+                npy_intp k = ntime*j+i;
+                for(size_t m=0; m<nsel; m++)
+                    ptrs[m].set(k, vals[sel[m]]);
+            }
+        }
+    };
+
+    Py_BEGIN_ALLOW_THREADS
+
+    // Split over time if there are enough utcs to go round, otherwise over
+    // targets, which means some duplication of the star-independent work.
+    if(ntime >= nthreads_to_use(nthreads)){
+        parallel_for(ntime, nthreads, [&](npy_intp i1, npy_intp i2){
+                block(i1, i2, 0, ntarg);
+            });
+    }else{
+        parallel_for(ntarg, nthreads, [&](npy_intp j1, npy_intp j2){
+                block(0, ntime, j1, j2);
+            });
+    }
+
+    Py_END_ALLOW_THREADS
+
+
+    // return  airmass, altitude (deg), azimuth (deg, N=0, E=90),
+    // hour angle, parallactic angle, angle of refraction
+    return output_tuple(sel, outs);
+}
+
+// Computes utc2tdb for many targets at a set of utcs. tt and tdb, which do
+// not depend upon the target, are returned as 1D arrays of length ntime, the
+// rest as 2D arrays of shape (ntarget,ntime). The observatory's position and
+// velocity are computed once per utc and shared by all targets.
+
+static PyObject*
+utc2tdb_batch_compute(Caches& caches, PyObject *iutc, const Site& site,
+                      const std::vector<Star>& stars, int nthreads, bool interp, PyObject *outputs,
+                      bool single, PyObject *out)
+{
+    PROFILE(ST_UTC2TDB);
+    bool scalar;
+    double vutc;
+    if(!check_utc("sla.utc2tdb_batch", iutc, scalar, vutc))
+        return NULL;
+
+    std::vector<int> sel;
+    unsigned want;
+    if(!set_outputs("sla.utc2tdb_batch", outputs, NTDB, TDB_OUTPUTS, sel, want))
+        return NULL;
+
+    Array_input utc;
+    if(scalar){
+        utc.set(vutc);
+    }else if(!utc.set(iutc)){
+        return NULL;
+    }
+    npy_intp ntime = utc.size();
+    npy_intp ntarg    = stars.size();
+
+    double t1 = 0., t2 = 0.;
+    if(interp && !table_range("sla.utc2tdb_batch", 1, &utc, t1, t2)){
+        return NULL;
+    }
+
+    // tt and tdb are 1D, the rest 2D
+    npy_intp dims[2] = {ntarg, ntime};
+    const int nds[NTDB] = {1, 1, 2, 2, 2, 2, 2};
+    PyArrayObject *outs[NTDB];
+    Out_ptr ptrs[NTDB];
+    if(!select_outputs("sla.utc2tdb_batch", out, sel, nds, TDB_TIME, single, 2, dims, outs, ptrs)){
+        return NULL;
+    }
+    const size_t nsel = sel.size();
+
+    // the target-dependent work is skipped if only tt and tdb are wanted
+    const bool targ2d = (want & (4|8|16|32|64)) != 0;
+    const Star_soa soa(stars);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    Earth_table *etab = interp ?
+        new_earth_table(caches.file, t1, t2, nthreads) : NULL;
+
+    // Covers utcs it1 to it2-1 for targets j1 to j2-1. The 1D outputs are
+    // written by the block which includes the first target.
+    auto block = [&](npy_intp it1, npy_intp it2, npy_intp j1, npy_intp j2){
+        Observer_state obs;
+        std::vector<double> hcorr(j2-j1), bcorr(j2-j1), vhel(j2-j1), vbar(j2-j1);
+        double vals[NTDB];
+        for(npy_intp i=it1; i<it2; i++){
+            if(i == it1 || utc[i] != utc[i-1]){
+                observer_state(utc[i], site, etab, obs);
+                if(targ2d)
+                    PROFILE_CALL(ST_TARGET, tdb_kernel(soa, j1, j2, obs, want, hcorr.data(),
+                                                       bcorr.data(), vhel.data(), vbar.data()));
+            }
+            if(j1 == 0){
+                vals[0] = obs.tt;
+                vals[1] = obs.tdb;
+                for(size_t m=0; m<nsel; m++)
+                    if(nds[sel[m]] == 1) ptrs[m].set(i, vals[sel[m]]);
+            }
+            if(!targ2d) continue;
+            for(npy_intp j=j1; j<j2; j++){
+                npy_intp jj = j-j1;
+                vals[2] = obs.tdb + bcorr[jj];
+                vals[3] = obs.utc + hcorr[jj];
+                vals[4] = obs.tdb + hcorr[jj];
+                vals[5] = vhel[jj];
+                vals[6] = vbar[jj];
+                npy_intp k = ntime*j+i;
+                for(size_t m=0; m<nsel; m++)
+                    if(nds[sel[m]] == 2) ptrs[m].set(k, vals[sel[m]]);
+            }
+        }
+    };
+
+    // Split over time if there are enough utcs to go round, otherwise over
+    // targets, which means some duplication of the target-independent work.
+    if(ntime >= nthreads_to_use(nthreads)){
+        parallel_for(ntime, nthreads, [&](npy_intp i1, npy_intp i2){
+                block(i1, i2, 0, ntarg);
+            });
+    }else{
+        parallel_for(ntarg, nthreads, [&](npy_intp j1, npy_intp j2){
+                block(0, ntime, j1, j2);
+            });
+    }
+
+    delete etab;
+
+    Py_END_ALLOW_THREADS
+
+
+    return output_tuple(sel, outs);
+}
+
+// Computes TDB time corrected for light travel given a UTC (in MJD), 
+// a target position (ICRS), and observatory position
+
+static PyObject* 
+sla_utc2tdb(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL;
+    double ra, dec, longitude, latitude, height;
+    double pmra = 0., pmdec = 0., epoch = 2000., parallax = 0., rv = 0.;
+    PyObject *out = NULL, *outputs = NULL, *dtype = NULL;
+    int nthreads = 1;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc", "longitude", "latitude", "height", "ra", "dec",
+                                   "pmra", "pmdec", "epoch", "parallax", "rv", "nthreads",
+                                   "mode", "outputs", "dtype", "out", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "Oddddd|dddddisOOO:sla.utc2tdb", const_cast<char**>(kwlist),
+                                    &iutc, &longitude, &latitude, &height, &ra, &dec, 
+                                    &pmra, &pmdec, &epoch, &parallax, &rv, &nthreads, &mode, &outputs, &dtype, &out))
+	return NULL;
+
+    bool interp;
+    if(!set_mode("sla.utc2tdb", mode, interp))
+        return NULL;
+
+    Site site;
+    if(!set_site("sla.utc2tdb", longitude, latitude, height, site))
+        return NULL;
+
+    Star star;
+    if(!set_star("sla.utc2tdb", ra, dec, pmra, pmdec, epoch, parallax, rv, star))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.utc2tdb", dtype, single))
+        return NULL;
+
+    return utc2tdb_compute(*module_state(self)->caches, iutc, site, star, nthreads, interp, outputs,
+                           single, out);
+};
+
+// Computes TDB times corrected for light travel for many targets at once
+
+static PyObject* 
+sla_utc2tdb_batch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL, *ra = NULL, *dec = NULL, *pmra = NULL, *pmdec = NULL;
+    PyObject *epoch = NULL, *parallax = NULL, *rv = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    double longitude, latitude, height;
+    int nthreads = 1;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc", "longitude", "latitude", "height", "ra", "dec",
+                                   "pmra", "pmdec", "epoch", "parallax", "rv", "nthreads",
+                                   "mode", "outputs", "dtype", "out", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OdddOO|OOOOOisOOO:sla.utc2tdb_batch", 
+                                    const_cast<char**>(kwlist), &iutc, &longitude, &latitude, 
+                                    &height, &ra, &dec, &pmra, &pmdec, &epoch, &parallax, &rv, 
+                                    &nthreads, &mode, &outputs, &dtype, &out))
+	return NULL;
+
+    bool interp;
+    if(!set_mode("sla.utc2tdb_batch", mode, interp))
+        return NULL;
+
+    Site site;
+    if(!set_site("sla.utc2tdb_batch", longitude, latitude, height, site))
+        return NULL;
+
+    std::vector<Star> stars;
+    if(!set_stars("sla.utc2tdb_batch", ra, dec, pmra, pmdec, epoch, parallax, rv, stars))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.utc2tdb_batch", dtype, single))
+        return NULL;
+
+    return utc2tdb_batch_compute(*module_state(self)->caches, iutc, site, stars, nthreads, interp,
+                                 outputs, single, out);
+};
+
+// Computes observational parameters such as airmass, altititude and elevation
+
+static PyObject* 
+sla_amass(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    PyObject *iutc = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    double ra, dec, longitude, latitude, height;
+    double wave=0.55, pmra = 0., pmdec = 0., epoch = 2000., parallax = 0., rv = 0.;
+    double temp = 285., pressure = 1013.25, rh = 0.2, tlr = 0.0065, dut = 0., xp = 0., yp = 0.;
+    static const char *kwlist[] = {"utc", "longitude", "latitude", "height", "ra", "dec",
+                                   "wave", "pmra", "pmdec", "epoch", "parallax", "rv",
+                                   "temp", "pressure", "rh", "tlr", "dut", "xp", "yp",
+                                   "outputs", "dtype", "out", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "Oddddd|dddddddddddddOOO:sla.amass", 
+                                    const_cast<char**>(kwlist), &iutc, &longitude, &latitude, 
+                                    &height, &ra, &dec, &wave, &pmra, &pmdec, &epoch, &parallax, 
+                                    &rv, &temp, &pressure, &rh, &tlr, &dut, &xp, &yp, 
+                                    &outputs, &dtype, &out))
+	return NULL;
+
+    Site site;
+    if(!set_site("sla.amass", longitude, latitude, height, site) ||
+       !set_eop("sla.amass", dut, xp, yp, site))
+        return NULL;
+
+    Star star;
+    if(!set_star("sla.amass", ra, dec, pmra, pmdec, epoch, parallax, rv, star))
+        return NULL;
+
+    Atmosphere atmos;
+    if(!set_atmos("sla.amass", wave, rh, atmos, temp, pressure, tlr))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.amass", dtype, single))
+        return NULL;
+
+    return amass_compute(*module_state(self)->caches, iutc, site, star, atmos, outputs, single, out);
+};
+
+
+// Computes observational parameters for many targets at once
+
+static PyObject* 
+sla_amass_batch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    PyObject *iutc = NULL, *ra = NULL, *dec = NULL, *pmra = NULL, *pmdec = NULL;
+    PyObject *epoch = NULL, *parallax = NULL, *rv = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    double longitude, latitude, height, wave=0.55;
+    double temp = 285., pressure = 1013.25, rh = 0.2, tlr = 0.0065, dut = 0., xp = 0., yp = 0.;
+    int nthreads = 1;
+    static const char *kwlist[] = {"utc", "longitude", "latitude", "height", "ra", "dec",
+                                   "wave", "pmra", "pmdec", "epoch", "parallax", "rv",
+                                   "temp", "pressure", "rh", "tlr", "dut", "xp", "yp",
+                                   "nthreads", "outputs", "dtype", "out", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OdddOO|dOOOOOdddddddiOOO:sla.amass_batch", 
+                                    const_cast<char**>(kwlist), &iutc, &longitude, &latitude, 
+                                    &height, &ra, &dec, &wave, &pmra, &pmdec, &epoch, 
+                                    &parallax, &rv, &temp, &pressure, &rh, &tlr, &dut, &xp, &yp,
+                                    &nthreads, &outputs, &dtype, &out))
+	return NULL;
+
+    Site site;
+    if(!set_site("sla.amass_batch", longitude, latitude, height, site) ||
+       !set_eop("sla.amass_batch", dut, xp, yp, site))
+        return NULL;
+
+    std::vector<Star> stars;
+    if(!set_stars("sla.amass_batch", ra, dec, pmra, pmdec, epoch, parallax, rv, stars))
+        return NULL;
+
+    Atmosphere atmos;
+    if(!set_atmos("sla.amass_batch", wave, rh, atmos, temp, pressure, tlr))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.amass_batch", dtype, single))
+        return NULL;
+
+    return amass_batch_compute(*module_state(self)->caches, iutc, site, stars, atmos, nthreads,
+                               outputs, single, out);
+};
+
+// Computes position of the Sun
+
+static PyObject* 
+sla_sun(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    PyObject *iutc = NULL, *out = NULL;
+    double longitude, latitude, height, wave=0.55, rh=0.2;
+    int fast=1, nthreads=1, rtable=0;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc", "longitude", "latitude", "height", "wave", "rh",
+                                   "fast", "nthreads", "mode", "rtable", "out", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "Oddd|ddiisiO:sla.sun", const_cast<char**>(kwlist),
+                                    &iutc, &longitude, &latitude, &height, &wave, &rh, &fast, 
+                                    &nthreads, &mode, &rtable, &out))
+	return NULL;
+
+    bool interp;
+    if(!set_mode("sla.sun", mode, interp))
+        return NULL;
+
+    Site site;
+    if(!set_site("sla.sun", longitude, latitude, height, site))
+        return NULL;
+
+    Atmosphere atmos;
+    if(!set_atmos("sla.sun", wave, rh, atmos))
+        return NULL;
+
+    return sun_compute(*module_state(self)->caches, iutc, site, atmos, fast, nthreads, interp, rtable, out);
+};
+
+// TT-UTC from a table of the steps in TAI-UTC since 1972 January 1, when
+// leap seconds began, found once by probing slaDat at the start of every
+// month. Earlier utcs, for which TAI-UTC varies continuously, fall back to
+// slaDtt. The results are identical to those of slaDtt.
+
+class Leap_table {
+public:
+
+    // Returns the table, constructing it on first use
+    static const Leap_table& get(){
+        static const Leap_table table;
+        return table;
+    }
+
+    // Returns TT-UTC, seconds
+    double dtt(double utc) const {
+        if(!(utc >= mjd[0])) return slaDtt(utc);
+        size_t i = std::upper_bound(mjd.begin(), mjd.end(), utc) - mjd.begin() - 1;
+        return 32.184 + dat[i];
+    }
+
+private:
+
+    Leap_table();
+
+    // mjd[i] is the start of the interval over which TAI-UTC = dat[i]
+    std::vector<double> mjd, dat;
+};
+
+Leap_table::Leap_table()
+{
+    mjd.push_back(41317.);
+    dat.push_back(slaDat(mjd[0]));
+    for(int year=1972; year<=2200; year++){
+        for(int month=1; month<=12; month++){
+            double m;
+            int status;
+            slaCldj(year, month, 1, &m, &status);
+            double d = slaDat(m);
+            if(d != dat.back()){
+                mjd.push_back(m);
+                dat.push_back(d);
+            }
+        }
+    }
+}
 
 // Implements slaDtt
 
@@ -17,734 +2536,1897 @@ static PyObject*
 sla_dtt(PyObject *self, PyObject *args)
 {
 
-    double utc;
-    if(!PyArg_ParseTuple(args, "d:sla.dtt", &utc))
+    PyObject *iutc = NULL;
+    if(!PyArg_ParseTuple(args, "O:sla.dtt", &iutc))
+        return NULL;
+
+    bool scalar;
+    double vutc;
+    if(!check_utc("sla.dtt", iutc, scalar, vutc))
+        return NULL;
+
+    if(scalar){
+        double d = slaDtt(vutc);
+        return Py_BuildValue("d", d);
+    }
+
+    Array_input utc;
+    if(!utc.set(iutc)) return NULL;
+    npy_intp dim[1] = {utc.size()};
+    PyArrayObject *outs[1];
+    if(!get_outputs("sla.dtt", NULL, 1, 0, 1, 1, dim, outs))
+        return NULL;
+    double *d = (double*) PyArray_DATA(outs[0]);
+
+    const Leap_table& leap = Leap_table::get();
+    for(npy_intp i=0; i<dim[0]; i++)
+        d[i] = leap.dtt(utc[i]);
+
+    return Py_BuildValue("N", outs[0]);
+};
+
+// Implements slaCldj
+
+static PyObject*
+sla_cldj(PyObject *self, PyObject *args)
+{
+
+    const int NPAR = 3;
+    PyObject *objs[NPAR];
+    if(!PyArg_ParseTuple(args, "OOO:sla.cldj", objs, objs+1, objs+2))
+        return NULL;
+
+    if(!PyArray_Check(objs[0]) && !PyArray_Check(objs[1]) && !PyArray_Check(objs[2])){
+
+        int year, month, day;
+        if(!PyArg_ParseTuple(args, "iii:sla.cldj", &year, &month, &day))
+            return NULL;
+
+        double mjd;
+        int status;
+        slaCldj(year, month, day, &mjd, &status);
+        if(status == 1){
+            PyErr_SetString(PyExc_ValueError, ("sla.cldj: bad year = " +
+                                               Subs::str(year)).c_str());
+            return NULL;
+        }else if(status == 2){
+            PyErr_SetString(PyExc_ValueError, ("sla.cldj: bad month = " +
+                                               Subs::str(month)).c_str());
+            return NULL;
+        }else if(status == 3){
+            PyErr_SetString(PyExc_ValueError, ("sla.cldj: bad day = " +
+                                               Subs::str(day)).c_str());
+            return NULL;
+        }
+        return Py_BuildValue("d", mjd);
+    }
+
+    const char *pnames[NPAR] = {"year", "month", "day"};
+    double defs[NPAR]        = {0., 0., 0.};
+    Array_input ins[NPAR];
+    npy_intp n;
+    bool scalar;
+    if(!set_inputs("sla.cldj", NPAR, objs, pnames, defs, ins, n, scalar))
+        return NULL;
+
+    npy_intp dim[1] = {n};
+    PyArrayObject *outs[1];
+    if(!get_outputs("sla.cldj", NULL, 1, 0, 1, 1, dim, outs))
+        return NULL;
+    double *mjd = (double*) PyArray_DATA(outs[0]);
+
+    for(npy_intp i=0; i<n; i++){
+        // as for the "iii" of scalars, only integers are accepted
+        for(int k=0; k<NPAR; k++){
+            double x = ins[k][i];
+            if(!(x == std::floor(x) && std::fabs(x) <= 2147483647.)){
+                PyErr_SetString(PyExc_ValueError, ("sla.cldj, element " + Subs::str(i) + ": " +
+                                                   pnames[k] + " must be an integer").c_str());
+                release_outputs(1, outs);
+                return NULL;
+            }
+        }
+        int year = int(ins[0][i]), month = int(ins[1][i]), day = int(ins[2][i]);
+        int status;
+        slaCldj(year, month, day, mjd+i, &status);
+        if(status){
+            std::string err = "sla.cldj, element " + Subs::str(i) + ": bad ";
+            if(status == 1)
+                err += "year = " + Subs::str(year);
+            else if(status == 2)
+                err += "month = " + Subs::str(month);
+            else
+                err += "day = " + Subs::str(day);
+            PyErr_SetString(PyExc_ValueError, err.c_str());
+            release_outputs(1, outs);
+            return NULL;
+        }
+    }
+    return Py_BuildValue("N", outs[0]);
+
+};
+
+// Implements slaDjcl
+
+static PyObject*
+sla_djcl(PyObject *self, PyObject *args)
+{
+
+    PyObject *imjd = NULL;
+    if(!PyArg_ParseTuple(args, "O:sla.djcl", &imjd))
+	return NULL;
+
+    bool scalar;
+    double vmjd;
+    if(!check_utc("sla.djcl", imjd, scalar, vmjd))
+        return NULL;
+
+    int year, month, day;
+    double frac;
+    int status;
+
+    if(scalar){
+        slaDjcl(vmjd, &year, &month, &day, &frac, &status);
+        if(status == -1){
+            PyErr_SetString(PyExc_ValueError, ("sla.djcl: bad date, < 4701 BC March 1"));
+            return NULL;
+        }
+        return Py_BuildValue("iiid", year, month, day, 24.*frac);
+    }
+
+    Array_input mjd;
+    if(!mjd.set(imjd)) return NULL;
+    npy_intp dim[1] = {mjd.size()};
+
+    PyArrayObject *outs[4] = {NULL, NULL, NULL, NULL};
+    for(int k=0; k<3; k++)
+        outs[k] = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_INT);
+    outs[3] = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_DOUBLE);
+    if(!outs[0] || !outs[1] || !outs[2] || !outs[3]){
+        for(int k=0; k<4; k++)
+            Py_XDECREF(outs[k]);
+        return NULL;
+    }
+    int *years     = (int*) PyArray_DATA(outs[0]);
+    int *months    = (int*) PyArray_DATA(outs[1]);
+    int *days      = (int*) PyArray_DATA(outs[2]);
+    double *hours  = (double*) PyArray_DATA(outs[3]);
+
+    for(npy_intp i=0; i<dim[0]; i++){
+        slaDjcl(mjd[i], years+i, months+i, days+i, &frac, &status);
+        if(status == -1){
+            PyErr_SetString(PyExc_ValueError, ("sla.djcl, element " + Subs::str(i) + 
+                                               ": bad date, < 4701 BC March 1").c_str());
+            release_outputs(4, outs);
+            return NULL;
+        }
+        hours[i] = 24.*frac;
+    }
+    return Py_BuildValue("NNNN", outs[0], outs[1], outs[2], outs[3]);
+};
+
+// Converts coordinates, scalar or array, from ICRS to galactic or back
+// with slaEqgal or slaGaleq. Arrays are split between nthreads threads.
+
+static PyObject* 
+coord_compute(const char *name, PyObject *c1, PyObject *c2, int nthreads, bool toGal)
+{
+    const char *pnames[2] = {toGal ? "ra" : "glong", toGal ? "dec" : "glat"};
+    PyObject *objs[2]     = {c1, c2};
+    double defs[2]        = {0., 0.};
+    Array_input ins[2];
+    npy_intp n;
+    bool scalar;
+    if(!set_inputs(name, 2, objs, pnames, defs, ins, n, scalar))
+        return NULL;
+
+    // convert angles to those expected by sla routines
+    const double CFAC = Constants::PI/180.;
+    const double F1   = toGal ? 15.*CFAC : CFAC;
+    const double F2   = toGal ? CFAC : 15.*CFAC;
+
+    if(scalar){
+        double o1, o2;
+        if(toGal)
+            slaEqgal(F1*ins[0][0], CFAC*ins[1][0], &o1, &o2);
+        else
+            slaGaleq(F1*ins[0][0], CFAC*ins[1][0], &o1, &o2);
+        return Py_BuildValue("dd", o1/F2, o2/CFAC);
+    }
+
+    npy_intp dim[1] = {n};
+    PyArrayObject *outs[2];
+    if(!get_outputs(name, NULL, 2, 0, 2, 1, dim, outs))
+        return NULL;
+    double *out1 = (double*) PyArray_DATA(outs[0]);
+    double *out2 = (double*) PyArray_DATA(outs[1]);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    parallel_for(n, nthreads, [&](npy_intp i1, npy_intp i2){
+            for(npy_intp i=i1; i<i2; i++){
+                if(toGal)
+                    slaEqgal(F1*ins[0][i], CFAC*ins[1][i], out1+i, out2+i);
+                else
+                    slaGaleq(F1*ins[0][i], CFAC*ins[1][i], out1+i, out2+i);
+                out1[i] /= F2;
+                out2[i] /= CFAC;
+            }
+        });
+
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("NN", outs[0], outs[1]);
+}
+
+static PyObject* 
+sla_eqgal(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    PyObject *ra = NULL, *dec = NULL;
+    int nthreads = 1;
+    static const char *kwlist[] = {"ra", "dec", "nthreads", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i:sla.eqgal", const_cast<char**>(kwlist),
+                                    &ra, &dec, &nthreads))
+	return NULL;
+
+    return coord_compute("sla.eqgal", ra, dec, nthreads, true);
+};
+
+static PyObject* 
+sla_galeq(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    PyObject *l = NULL, *b = NULL;
+    int nthreads = 1;
+    static const char *kwlist[] = {"glong", "glat", "nthreads", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i:sla.galeq", const_cast<char**>(kwlist),
+                                    &l, &b, &nthreads))
+	return NULL;
+
+    return coord_compute("sla.galeq", l, b, nthreads, false);
+};
+
+// Finds when the Sun crosses given elevations
+
+static PyObject* 
+sla_sun_root(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    const int NPAR = 6;
+    PyObject *objs[NPAR] = {NULL, NULL, NULL, NULL, NULL, NULL};
+    double wave=0.55, rh=0.2, acc=1.e-5;
+    int fast=1, nthreads=1, rtable=0;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc1", "utc2", "elev", "longitude", "latitude", "height",
+                                   "wave", "rh", "acc", "fast", "nthreads", "mode", "rtable", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OOOOOO|dddiisi:sla.sun_root", const_cast<char**>(kwlist),
+                                    objs, objs+1, objs+2, objs+3, objs+4, objs+5, &wave, &rh,
+                                    &acc, &fast, &nthreads, &mode, &rtable))
+	return NULL;
+
+    bool interp;
+    if(!set_mode("sla.sun_root", mode, interp))
+        return NULL;
+
+    const char *pnames[NPAR] = {"utc1", "utc2", "elev", "longitude", "latitude", "height"};
+    double defs[NPAR]        = {0., 0., 0., 0., 0., 0.};
+    Array_input ins[NPAR];
+    npy_intp n;
+    bool scalar;
+    if(!set_inputs("sla.sun_root", NPAR, objs, pnames, defs, ins, n, scalar))
+        return NULL;
+
+    Atmosphere atmos;
+    if(!set_atmos("sla.sun_root", wave, rh, atmos))
+        return NULL;
+
+    // Check and convert the sites
+    std::vector<Site> sites(n);
+    for(npy_intp i=0; i<n; i++){
+        std::string name = scalar ? "sla.sun_root" : "sla.sun_root, element " + Subs::str(i);
+        if(!set_site(name, ins[3][i], ins[4][i], ins[5][i], sites[i]))
+            return NULL;
+    }
+
+    // Refraction tables, one per distinct site in a row
+    Caches& caches = *module_state(self)->caches;
+    std::vector<std::shared_ptr<const Refro_table> > rtabs(n);
+    if(rtable && !fast){
+        for(npy_intp i=0; i<n; i++){
+            if(i && rtabs[i-1]->matches(sites[i], atmos))
+                rtabs[i] = rtabs[i-1];
+            else
+                rtabs[i] = get_refro_table(caches.refro, sites[i], atmos, nthreads);
+        }
+    }
+
+    if(scalar)
+        return Py_BuildValue("d", sun_root_point(ins[0][0], ins[1][0], ins[2][0], sites[0],
+                                                 atmos, fast, NULL, rtabs[0].get(), acc));
+
+    double t1 = 0., t2 = 0.;
+    if(interp && !table_range("sla.sun_root", 2, ins, t1, t2))
+        return NULL;
+
+    npy_intp dim[1] = {n};
+    PyArrayObject *outs[1];
+    if(!get_outputs("sla.sun_root", NULL, 1, 0, 1, 1, dim, outs))
+        return NULL;
+    double *utc = (double*) PyArray_DATA(outs[0]);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    Earth_table *etab = interp ?
+        new_earth_table(caches.file, t1, t2, nthreads) : NULL;
+
+    parallel_for(n, nthreads, [&](npy_intp i1, npy_intp i2){
+            for(npy_intp i=i1; i<i2; i++)
+                utc[i] = sun_root_point(ins[0][i], ins[1][i], ins[2][i], sites[i], 
+                                        atmos, fast, etab, rtabs[i].get(), acc);
+        });
+
+    delete etab;
+
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("N", outs[0]);
+};
+
+// Returns the slaRefro lookup table used by sun with rtable=True
+
+static PyObject* 
+sla_refro_table(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    double latitude, height, wave=0.55, rh=0.2;
+    int nthreads=1;
+    static const char *kwlist[] = {"latitude", "height", "wave", "rh", "nthreads", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "dd|ddi:sla.refro_table", const_cast<char**>(kwlist),
+                                    &latitude, &height, &wave, &rh, &nthreads))
+	return NULL;
+
+    Site site;
+    if(!set_site("sla.refro_table", 0., latitude, height, site))
+        return NULL;
+
+    Atmosphere atmos;
+    if(!set_atmos("sla.refro_table", wave, rh, atmos))
+        return NULL;
+
+    Caches& caches = *module_state(self)->caches;
+    std::shared_ptr<const Refro_table> rtab = get_refro_table(caches.refro, site, atmos, nthreads);
+
+    const double CFAC = Constants::PI/180.;
+    npy_intp dim[1] = {rtab->nint+1};
+    PyArrayObject *outs[2];
+    if(!get_outputs("sla.refro_table", NULL, 2, 0, 2, 1, dim, outs))
+        return NULL;
+    double *zd  = (double*) PyArray_DATA(outs[0]);
+    double *ref = (double*) PyArray_DATA(outs[1]);
+    for(int i=0; i<=rtab->nint; i++){
+        zd[i]  = rtab->step*i/CFAC;
+        ref[i] = rtab->ref[i+1]/CFAC;
+    }
+
+    return Py_BuildValue("NNd", outs[0], outs[1], 3600.*rtab->maxerr/CFAC);
+};
+
+// Returns the profiling counters as a dictionary of (ncall, seconds) keyed
+// by stage name. Empty unless compiled with SLA_PROFILE.
+
+static PyObject*
+sla_stats(PyObject *self, PyObject *unused)
+{
+    PyObject *stats = PyDict_New();
+    if(stats == NULL) return NULL;
+
+#ifdef SLA_PROFILE
+    for(int i=0; i<NSTAGE; i++){
+        unsigned long long ncall = stage_calls[i].load();
+        if(ncall == 0) continue;
+        PyObject *value = Py_BuildValue("Kd", ncall, 1.e-9*stage_ns[i].load());
+        if(value == NULL || PyDict_SetItemString(stats, STAGE_NAMES[i], value)){
+            Py_XDECREF(value);
+            Py_DECREF(stats);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+#endif
+
+    return stats;
+};
+
+// Zeroes the profiling counters
+
+static PyObject*
+sla_reset_stats(PyObject *self, PyObject *unused)
+{
+#ifdef SLA_PROFILE
+    for(int i=0; i<NSTAGE; i++){
+        stage_ns[i]    = 0;
+        stage_calls[i] = 0;
+    }
+#endif
+    Py_RETURN_NONE;
+};
+
+// Writes a table file for mode='interp'
+
+static PyObject*
+sla_build_cache(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *fname;
+    double mjd1, mjd2;
+    int nthreads = 1;
+    static const char *kwlist[] = {"fname", "mjd1", "mjd2", "nthreads", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "sdd|i:sla.build_cache", const_cast<char**>(kwlist),
+                                    &fname, &mjd1, &mjd2, &nthreads))
         return NULL;
 
-    double d = slaDtt(utc);
+    // TDB exceeds UTC by less than 0.01 days
+    double t1 = mjd1, t2 = mjd2 + 0.01;
+    if(!(mjd2 >= mjd1)){
+        PyErr_SetString(PyExc_ValueError, "sla.build_cache: mjd2 must be at least mjd1");
+        return NULL;
+    }
+    if(Earth_table::nnode(t1, t2, Earth_table::STEP) > Earth_table::MAXNODE){
+        PyErr_SetString(PyExc_ValueError, "sla.build_cache: range from mjd1 to mjd2 too large");
+        return NULL;
+    }
 
-    return Py_BuildValue("d", d);
+    bool ok;
+    std::string error;
+    Py_BEGIN_ALLOW_THREADS
+    Earth_table etab(t1, t2, Earth_table::STEP, nthreads);
+    ok = Table_file::write(fname, etab, error);
+    Py_END_ALLOW_THREADS
 
+    if(!ok){
+        PyErr_SetString(PyExc_IOError, ("sla.build_cache: " + error).c_str());
+        return NULL;
+    }
+    Py_RETURN_NONE;
 };
 
-// Implements slaCldj
+// Maps a table file for mode='interp'
 
 static PyObject*
-sla_cldj(PyObject *self, PyObject *args)
+sla_load_cache(PyObject *self, PyObject *args, PyObject *kwds)
 {
+    const char *fname;
+    static const char *kwlist[] = {"fname", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s:sla.load_cache", const_cast<char**>(kwlist), &fname))
+        return NULL;
 
-    int year, month, day;
-    if(!PyArg_ParseTuple(args, "iii:sla.cldj", &year, &month, &day))
+    File_cache& cache = module_state(self)->caches->file;
+    std::string error;
+    if(!load_table_file(cache, fname, error)){
+        PyErr_SetString(PyExc_IOError, ("sla.load_cache: " + error).c_str());
         return NULL;
+    }
 
-    double mjd;
-    int status;
-    slaCldj(year, month, day, &mjd, &status);
-    if(status == 1){
-        PyErr_SetString(PyExc_ValueError, ("sla.cldj: bad year = " +
-                                           Subs::str(year)).c_str());
-        return NULL;
-    }else if(status == 2){
-        PyErr_SetString(PyExc_ValueError, ("sla.cldj: bad month = " +
-                                           Subs::str(month)).c_str());
-	return NULL;
-    }else if(status == 3){
-        PyErr_SetString(PyExc_ValueError, ("sla.cldj: bad day = " +
-                                           Subs::str(day)).c_str());
+    // the utcs which mode='interp' can take from the file
+    std::shared_ptr<const Table_file> file = cache.get();
+    return Py_BuildValue("dd", file->t0 + file->step, file->t0 + file->step*(file->nnodes-2) - 0.01);
+};
+
+// Convert FK4 B1950 to Fk5 J2000 coords
+
+static PyObject* 
+sla_fk425(PyObject *self, PyObject *args, PyObject *kwds)
+{
+
+    const int NPAR = 6;
+    PyObject *objs[NPAR] = {NULL, NULL, NULL, NULL, NULL, NULL};
+    int nthreads = 1;
+    static const char *kwlist[] = {"ra", "dec", "pmra", "pmdec", "parallax", "rv", "nthreads", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OOOOi:sla.fk425", const_cast<char**>(kwlist),
+                                    objs, objs+1, objs+2, objs+3, objs+4, objs+5, &nthreads))
 	return NULL;
+
+    const char *pnames[NPAR] = {"ra", "dec", "pmra", "pmdec", "parallax", "rv"};
+    double defs[NPAR]        = {0., 0., 0., 0., 0., 0.};
+    Array_input ins[NPAR];
+    npy_intp n;
+    bool scalar;
+    if(!set_inputs("sla.fk425", NPAR, objs, pnames, defs, ins, n, scalar))
+        return NULL;
+
+    // Some checks on the inputs
+    for(npy_intp i=0; i<n; i++){
+        std::string elem = scalar ? "" : ", element " + Subs::str(i);
+        double ra4 = ins[0][i], dec4 = ins[1][i];
+        if(ra4 < 0. || ra4 > 24.){
+            PyErr_SetString(PyExc_ValueError, ("sla.fk425" + elem + ": ra out of range 0 to 24").c_str());
+            return NULL;
+        }
+
+        if(dec4 < -90. || dec4 > +90.){
+            PyErr_SetString(PyExc_ValueError, ("sla.fk425" + elem + ": declination out of range -90 to +90").c_str());
+            return NULL;
+        }
+    }
+
+    // Converts element i, leaving the results in the order ra, dec, pmra,
+    // pmdec, parallax, rv
+    auto convert = [&](npy_intp i, double res[NPAR]){
+
+        // convert angles to those expected by sla routines
+        const double CFAC = Constants::PI/180.;
+        double rar4    = CFAC*15.*ins[0][i];
+        double decr4   = CFAC*ins[1][i];
+        double pmrar4  = CFAC*ins[2][i]/3600.;
+        double pmdecr4 = CFAC*ins[3][i]/3600.;
+
+        double rar5, decr5, pmrar5, pmdecr5;
+        slaFk425(rar4, decr4, pmrar4, pmdecr4, ins[4][i], ins[5][i], 
+                 &rar5, &decr5, &pmrar5, &pmdecr5, res+4, res+5);
+
+        res[0] = rar5/CFAC/15.;
+        res[1] = decr5/CFAC;
+        res[2] = 3600.*pmrar5/CFAC;
+        res[3] = 3600.*pmdecr5/CFAC;
+    };
+
+    if(scalar){
+        double res[NPAR];
+        convert(0, res);
+        return Py_BuildValue("dddddd", res[0], res[1], res[2], res[3], res[4], res[5]);
     }
-    return Py_BuildValue("d", mjd);
 
+    npy_intp dim[1] = {n};
+    PyArrayObject *outs[NPAR];
+    if(!get_outputs("sla.fk425", NULL, NPAR, 0, NPAR, 1, dim, outs))
+        return NULL;
+    double *optr[NPAR];
+    for(int k=0; k<NPAR; k++)
+        optr[k] = (double*) PyArray_DATA(outs[k]);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    parallel_for(n, nthreads, [&](npy_intp i1, npy_intp i2){
+            double res[NPAR];
+            for(npy_intp i=i1; i<i2; i++){
+                convert(i, res);
+                for(int k=0; k<NPAR; k++)
+                    optr[k][i] = res[k];
+            }
+        });
+
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("NNNNNN", outs[0], outs[1], outs[2], outs[3], outs[4], outs[5]);
 };
 
+//----------------------------------------------------------------------------------------
+// The Observatory and Target types. These store the checked and converted
+// site and target parameters so that repeated calls avoid the setup that
+// the module functions carry out each time.
 
-static PyObject*
-sla_djcl(PyObject *self, PyObject *args)
+struct Target {
+    PyObject_HEAD
+    double ra, dec, pmra, pmdec, epoch, parallax, rv;
+    Star star;
+};
+
+// Copies the star of a Target. As for observatory_get, the critical section
+// stops a repeated __init__ in another thread from tearing it.
+
+static void
+target_get(Target *self, Star& star)
 {
+    Py_BEGIN_CRITICAL_SECTION((PyObject*)self);
+    star = self->star;
+    Py_END_CRITICAL_SECTION();
+}
 
-    double mjd;
-    if(!PyArg_ParseTuple(args, "d", &mjd))
-	return NULL;
+// The Target is only changed once all the parameters have been checked, and
+// then within a critical section, since __init__ can be called again.
 
-    int year, month, day;
-    double frac;
-    int status;
-    slaDjcl(mjd, &year, &month, &day, &frac, &status);
-    if(status == -1){
-	PyErr_SetString(PyExc_ValueError, ("sla.djcl: bad date, < 4701 BC March 1"));
-	return NULL;
+static int
+Target_init(Target *self, PyObject *args, PyObject *kwds)
+{
+    double ra, dec, pmra = 0., pmdec = 0., epoch = 2000., parallax = 0., rv = 0.;
+    static const char *kwlist[] = {"ra", "dec", "pmra", "pmdec", "epoch", "parallax", "rv", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "dd|ddddd:sla.Target", const_cast<char**>(kwlist),
+                                    &ra, &dec, &pmra, &pmdec, &epoch, &parallax, &rv))
+        return -1;
+
+    Star star;
+    if(!set_star("sla.Target", ra, dec, pmra, pmdec, epoch, parallax, rv, star))
+        return -1;
+
+    Py_BEGIN_CRITICAL_SECTION((PyObject*)self);
+    self->ra       = ra;
+    self->dec      = dec;
+    self->pmra     = pmra;
+    self->pmdec    = pmdec;
+    self->epoch    = epoch;
+    self->parallax = parallax;
+    self->rv       = rv;
+    self->star     = star;
+    Py_END_CRITICAL_SECTION();
+
+    return 0;
+}
+
+static PyMemberDef Target_members[] = {
+    {(char*)"ra",       T_DOUBLE, offsetof(Target, ra),       READONLY, (char*)"ra, hours"},
+    {(char*)"dec",      T_DOUBLE, offsetof(Target, dec),      READONLY, (char*)"declination, degrees"},
+    {(char*)"pmra",     T_DOUBLE, offsetof(Target, pmra),     READONLY, (char*)"proper motion in ra, arcsec/year"},
+    {(char*)"pmdec",    T_DOUBLE, offsetof(Target, pmdec),    READONLY, (char*)"proper motion in dec, arcsec/year"},
+    {(char*)"epoch",    T_DOUBLE, offsetof(Target, epoch),    READONLY, (char*)"epoch of position, years"},
+    {(char*)"parallax", T_DOUBLE, offsetof(Target, parallax), READONLY, (char*)"parallax, arcsec"},
+    {(char*)"rv",       T_DOUBLE, offsetof(Target, rv),       READONLY, (char*)"radial velocity, km/s"},
+    {NULL}  /* Sentinel */
+};
+
+static bool
+get_stars(const std::string& name, PyTypeObject *target_type, PyObject *targets, 
+          std::vector<Star>& stars)
+{
+    PyObject *seq = PySequence_Fast(targets, (name + ": targets must be a sequence of Targets").c_str());
+    if(seq == NULL) return false;
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    stars.resize(n);
+    for(Py_ssize_t i=0; i<n; i++){
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        if(!PyObject_TypeCheck(item, target_type)){
+            PyErr_SetString(PyExc_TypeError, (name + ": targets must be a sequence of Targets").c_str());
+            Py_DECREF(seq);
+            return false;
+        }
+        target_get((Target*)item, stars[i]);
     }
-    return Py_BuildValue("iiid", year, month, day, 24.*frac);
+    Py_DECREF(seq);
+    return true;
+}
+
+struct Observatory {
+    PyObject_HEAD
+    double longitude, latitude, height, wave, rh, temp, pressure, tlr, dut, xp, yp;
+    Site site;
+    Atmosphere atmos;
 };
 
+// Copies the site and atmosphere of an Observatory, which the calculations
+// use without the GIL. The critical section stops an update in another
+// thread from tearing them in the free-threaded build.
 
-static PyObject* 
-sla_eqgal(PyObject *self, PyObject *args)
+static void
+observatory_get(Observatory *self, Site& site, Atmosphere& atmos)
 {
+    Py_BEGIN_CRITICAL_SECTION((PyObject*)self);
+    site  = self->site;
+    atmos = self->atmos;
+    Py_END_CRITICAL_SECTION();
+}
 
-    double ra, dec;
-    if(!PyArg_ParseTuple(args, "dd", &ra, &dec))
-	return NULL;
+// As for Target_init, the Observatory is only changed once all the
+// parameters have been checked, and then within a critical section.
 
-    // convert angles to those expected by sla routines
-    const double CFAC = Constants::PI/180.;
-    double rar    = CFAC*15.*ra;
-    double decr   = CFAC*dec;
-    
-    double glong, glat;
-    slaEqgal(rar, decr, &glong, &glat);
-    glong /= CFAC;
-    glat /= CFAC;
-    return Py_BuildValue("dd", glong, glat);
+static int
+Observatory_init(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    double longitude, latitude, height, wave = 0.55, rh = 0.2, temp = 285., pressure = 1013.25;
+    double tlr = 0.0065, dut = 0., xp = 0., yp = 0.;
+    static const char *kwlist[] = {"longitude", "latitude", "height", "wave", "rh", "temp",
+                                   "pressure", "tlr", "dut", "xp", "yp", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "ddd|dddddddd:sla.Observatory", const_cast<char**>(kwlist),
+                                    &longitude, &latitude, &height, &wave, &rh, &temp, &pressure,
+                                    &tlr, &dut, &xp, &yp))
+        return -1;
+
+    Site site;
+    if(!set_site("sla.Observatory", longitude, latitude, height, site) ||
+       !set_eop("sla.Observatory", dut, xp, yp, site))
+        return -1;
+
+    Atmosphere atmos;
+    if(!set_atmos("sla.Observatory", wave, rh, atmos, temp, pressure, tlr))
+        return -1;
+
+    Py_BEGIN_CRITICAL_SECTION((PyObject*)self);
+    self->longitude = longitude;
+    self->latitude  = latitude;
+    self->height    = height;
+    self->wave      = wave;
+    self->rh        = rh;
+    self->temp      = temp;
+    self->pressure  = pressure;
+    self->tlr       = tlr;
+    self->dut       = dut;
+    self->xp        = xp;
+    self->yp        = yp;
+    self->site      = site;
+    self->atmos     = atmos;
+    Py_END_CRITICAL_SECTION();
+
+    return 0;
+}
+
+// Changes the weather and Earth orientation parameters of an Observatory.
+// Only those given change, and the Observatory is left untouched if any
+// are out of range. Called within a critical section by Observatory_update.
+
+static PyObject*
+observatory_update(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    double wave = self->wave, rh = self->rh, temp = self->temp, pressure = self->pressure;
+    double tlr = self->tlr, dut = self->dut, xp = self->xp, yp = self->yp;
+    static const char *kwlist[] = {"wave", "rh", "temp", "pressure", "tlr", "dut", "xp", "yp", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|dddddddd:sla.Observatory.update", 
+                                    const_cast<char**>(kwlist), &wave, &rh, &temp, &pressure,
+                                    &tlr, &dut, &xp, &yp))
+        return NULL;
+
+    Site site = self->site;
+    if(!set_eop("sla.Observatory.update", dut, xp, yp, site))
+        return NULL;
+
+    Atmosphere atmos = self->atmos;
+    if((wave != self->wave || rh != self->rh || temp != self->temp || 
+        pressure != self->pressure || tlr != self->tlr) &&
+       !set_atmos("sla.Observatory.update", wave, rh, atmos, temp, pressure, tlr))
+        return NULL;
+
+    self->site     = site;
+    self->atmos    = atmos;
+    self->wave     = wave;
+    self->rh       = rh;
+    self->temp     = temp;
+    self->pressure = pressure;
+    self->tlr      = tlr;
+    self->dut      = dut;
+    self->xp       = xp;
+    self->yp       = yp;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+Observatory_update(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *result;
+    Py_BEGIN_CRITICAL_SECTION((PyObject*)self);
+    result = observatory_update(self, args, kwds);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+static PyObject*
+Observatory_utc2tdb(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL, *targ = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    int nthreads = 1;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc", "target", "nthreads", "mode", "outputs", "dtype", "out", NULL};
+    Module_state *state = type_state(Py_TYPE(self));
+    if(state == NULL) return NULL;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|isOOO:sla.Observatory.utc2tdb", const_cast<char**>(kwlist),
+                                    &iutc, state->target_type, &targ, &nthreads, &mode, &outputs, 
+                                    &dtype, &out))
+        return NULL;
+
+    bool interp;
+    if(!set_mode("sla.Observatory.utc2tdb", mode, interp))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.Observatory.utc2tdb", dtype, single))
+        return NULL;
+
+    Site site;
+    Atmosphere atmos;
+    observatory_get(self, site, atmos);
+    Star star;
+    target_get((Target*)targ, star);
+    return utc2tdb_compute(*state->caches, iutc, site, star, nthreads, interp,
+                           outputs, single, out);
+}
+
+static PyObject*
+Observatory_utc2tdb_batch(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL, *targets = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    int nthreads = 1;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc", "targets", "nthreads", "mode", "outputs", "dtype", "out", NULL};
+    Module_state *state = type_state(Py_TYPE(self));
+    if(state == NULL) return NULL;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|isOOO:sla.Observatory.utc2tdb_batch", 
+                                    const_cast<char**>(kwlist), &iutc, &targets, &nthreads, &mode, &outputs, &dtype, &out))
+        return NULL;
+
+    bool interp;
+    if(!set_mode("sla.Observatory.utc2tdb_batch", mode, interp))
+        return NULL;
+
+    std::vector<Star> stars;
+    if(!get_stars("sla.Observatory.utc2tdb_batch", state->target_type, targets, stars))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.Observatory.utc2tdb_batch", dtype, single))
+        return NULL;
+
+    Site site;
+    Atmosphere atmos;
+    observatory_get(self, site, atmos);
+    return utc2tdb_batch_compute(*state->caches, iutc, site, stars, nthreads, interp, outputs, 
+                                 single, out);
+}
+
+static PyObject*
+Observatory_amass(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL, *targ = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    static const char *kwlist[] = {"utc", "target", "outputs", "dtype", "out", NULL};
+    Module_state *state = type_state(Py_TYPE(self));
+    if(state == NULL) return NULL;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|OOO:sla.Observatory.amass", const_cast<char**>(kwlist),
+                                    &iutc, state->target_type, &targ, &outputs, &dtype, &out))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.Observatory.amass", dtype, single))
+        return NULL;
+
+    Site site;
+    Atmosphere atmos;
+    observatory_get(self, site, atmos);
+    Star star;
+    target_get((Target*)targ, star);
+    return amass_compute(*state->caches, iutc, site, star, atmos, outputs, single, out);
+}
+
+static PyObject*
+Observatory_amass_batch(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL, *targets = NULL, *out = NULL, *outputs = NULL, *dtype = NULL;
+    int nthreads = 1;
+    static const char *kwlist[] = {"utc", "targets", "nthreads", "outputs", "dtype", "out", NULL};
+    Module_state *state = type_state(Py_TYPE(self));
+    if(state == NULL) return NULL;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iOOO:sla.Observatory.amass_batch", 
+                                    const_cast<char**>(kwlist), &iutc, &targets, &nthreads, &outputs, &dtype, &out))
+        return NULL;
+
+    std::vector<Star> stars;
+    if(!get_stars("sla.Observatory.amass_batch", state->target_type, targets, stars))
+        return NULL;
+
+    bool single;
+    if(!set_dtype("sla.Observatory.amass_batch", dtype, single))
+        return NULL;
+
+    Site site;
+    Atmosphere atmos;
+    observatory_get(self, site, atmos);
+    return amass_batch_compute(*state->caches, iutc, site, stars, atmos, nthreads, outputs, single, out);
+}
+
+static PyObject*
+Observatory_sun(Observatory *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iutc = NULL, *out = NULL;
+    int fast = 1, nthreads = 1, rtable = 0;
+    const char *mode = "exact";
+    static const char *kwlist[] = {"utc", "fast", "nthreads", "mode", "rtable", "out", NULL};
+    Module_state *state = type_state(Py_TYPE(self));
+    if(state == NULL) return NULL;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|iisiO:sla.Observatory.sun", const_cast<char**>(kwlist),
+                                    &iutc, &fast, &nthreads, &mode, &rtable, &out))
+        return NULL;
+
+    bool interp;
+    if(!set_mode("sla.Observatory.sun", mode, interp))
+        return NULL;
+
+    Site site;
+    Atmosphere atmos;
+    observatory_get(self, site, atmos);
+    return sun_compute(*state->caches, iutc, site, atmos, fast, nthreads, interp, rtable, out);
+}
+
+static PyMethodDef Observatory_methods[] = {
+
+    {"utc2tdb", (PyCFunction)Observatory_utc2tdb, METH_VARARGS | METH_KEYWORDS,
+     "tt,tdb,btdb,hutc,htdb,vhel,vbar = utc2tdb(utc,target,nthreads=1,mode='exact',outputs=None,dtype=None,\n"
+     "                                   out=None)\n\n"
+     "As the module function utc2tdb, with the target specified by a Target."},
+
+    {"utc2tdb_batch", (PyCFunction)Observatory_utc2tdb_batch, METH_VARARGS | METH_KEYWORDS,
+     "tt,tdb,btdb,hutc,htdb,vhel,vbar = utc2tdb_batch(utc,targets,nthreads=1,mode='exact',outputs=None,\n"
+     "                                   dtype=None,out=None)\n\n"
+     "As the module function utc2tdb_batch, with the targets specified by a sequence of\n"
+     "Targets."},
+
+    {"amass", (PyCFunction)Observatory_amass, METH_VARARGS | METH_KEYWORDS,
+     "airmass, alt, az, ha, pa, delz = amass(utc,target,outputs=None,dtype=None,out=None)\n\n"
+     "As the module function amass, with the target specified by a Target. The\n"
+     "weather and Earth orientation parameters are those of the Observatory."},
+
+    {"amass_batch", (PyCFunction)Observatory_amass_batch, METH_VARARGS | METH_KEYWORDS,
+     "airmass, alt, az, ha, pa, delz = amass_batch(utc,targets,nthreads=1,outputs=None,dtype=None,out=None)\n\n"
+     "As the module function amass_batch, with the targets specified by a sequence of\n"
+     "Targets. The outputs are 2D arrays of shape (len(targets),len(utc))."},
+
+    {"sun", (PyCFunction)Observatory_sun, METH_VARARGS | METH_KEYWORDS,
+     "azimuth,elevation,refract,ra,dec = sun(utc,fast=True,nthreads=1,mode='exact',rtable=False,out=None)\n\n"
+     "As the module function sun. The wavelength and weather are those of the\n"
+     "Observatory."},
+
+    {"update", (PyCFunction)Observatory_update, METH_VARARGS | METH_KEYWORDS,
+     "update(wave=,rh=,temp=,pressure=,tlr=,dut=,xp=,yp=)\n\n"
+     "Changes any of the weather and Earth orientation parameters of the Observatory, given\n"
+     "by keyword, e.g. as new weather readings come in; those not given are unchanged. The slaRefco\n"
+     "refraction constants for the last few combinations of site, weather and Earth\n"
+     "orientation are cached, so switching between them costs little."},
+
+    {NULL}  /* Sentinel */
 };
 
-static PyObject* 
-sla_galeq(PyObject *self, PyObject *args)
+static PyMemberDef Observatory_members[] = {
+    {(char*)"longitude", T_DOUBLE, offsetof(Observatory, longitude), READONLY, (char*)"longitude, degrees, east positive"},
+    {(char*)"latitude",  T_DOUBLE, offsetof(Observatory, latitude),  READONLY, (char*)"latitude, degrees"},
+    {(char*)"height",    T_DOUBLE, offsetof(Observatory, height),    READONLY, (char*)"height, metres"},
+    {(char*)"wave",      T_DOUBLE, offsetof(Observatory, wave),      READONLY, (char*)"wavelength, microns"},
+    {(char*)"rh",        T_DOUBLE, offsetof(Observatory, rh),        READONLY, (char*)"relative humidity, 0 to 1"},
+    {(char*)"temp",      T_DOUBLE, offsetof(Observatory, temp),      READONLY, (char*)"ambient temperature, K"},
+    {(char*)"pressure",  T_DOUBLE, offsetof(Observatory, pressure),  READONLY, (char*)"ambient pressure, mbar"},
+    {(char*)"tlr",       T_DOUBLE, offsetof(Observatory, tlr),       READONLY, (char*)"tropospheric lapse rate, K/metre"},
+    {(char*)"dut",       T_DOUBLE, offsetof(Observatory, dut),       READONLY, (char*)"UT1-UTC, seconds"},
+    {(char*)"xp",        T_DOUBLE, offsetof(Observatory, xp),        READONLY, (char*)"polar motion x, arcsec"},
+    {(char*)"yp",        T_DOUBLE, offsetof(Observatory, yp),        READONLY, (char*)"polar motion y, arcsec"},
+    {NULL}  /* Sentinel */
+};
+
+// Deallocates an instance of either type, which as heap types own a
+// reference to their type
+
+static void
+heap_dealloc(PyObject *self)
 {
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
 
-    double l, b;
-    if(!PyArg_ParseTuple(args, "dd", &l, &b))
-	return NULL;
+// The types are heap types, created afresh by each module object. They are
+// immutable where Python supports that, as the static types were.
 
-    // convert angles to those expected by sla routines
-    const double CFAC = Constants::PI/180.;
-    double lr   = CFAC*l;
-    double br   = CFAC*b;
-    
-    double ra, dec;
-    slaGaleq(lr, br, &ra, &dec);
-    ra   /= 15.*CFAC;
-    dec  /= CFAC;
-    return Py_BuildValue("dd", ra, dec);
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define SLA_TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE)
+#else
+#define SLA_TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE)
+#endif
+
+static PyType_Slot Target_slots[] = {
+    {Py_tp_doc, (void*)
+        "Target(ra,dec,pmra=0,pmdec=0,epoch=2000,parallax=0,rv=0)\n\n"
+        "Stores a target position for use by the methods of Observatory. ra and dec (ICRS)\n"
+        "are in hours and degrees; proper motions are in arcsec/year (not seconds of RA);\n"
+        "parallax is in arcsec and the radial velocity is in km/s. The values are checked\n"
+        "and converted once on creation."},
+    {Py_tp_members, Target_members},
+    {Py_tp_init,    (void*)Target_init},
+    {Py_tp_new,     (void*)PyType_GenericNew},
+    {Py_tp_dealloc, (void*)heap_dealloc},
+    {0, NULL}
 };
 
-// Computes TDB time corrected for light travel given a UTC (in MJD), 
-// a target position (ICRS), and observatory position
+static PyType_Spec Target_spec = {
+    "_sla.Target", sizeof(Target), 0, SLA_TYPE_FLAGS, Target_slots
+};
+
+static PyType_Slot Observatory_slots[] = {
+    {Py_tp_doc, (void*)
+        "Observatory(longitude,latitude,height,wave=0.55,rh=0.2,temp=285,pressure=1013.25,\n"
+        "            tlr=0.0065,dut=0,xp=0,yp=0)\n\n"
+        "Stores an observing site, longitude and latitude in degrees, east positive, height\n"
+        "in metres, along with the wavelength of observation in microns and the relative\n"
+        "humidity, temperature (K), pressure (mbar) and lapse rate (K/metre) used for refraction\n"
+        "and the Earth orientation parameters UT1-UTC (seconds) and polar motion (arcsec). The\n"
+        "values are checked and converted once on creation, or by the method update, so that\n"
+        "the methods utc2tdb, amass and sun avoid the setup overheads of the module functions\n"
+        "of the same names."},
+    {Py_tp_methods, Observatory_methods},
+    {Py_tp_members, Observatory_members},
+    {Py_tp_init,    (void*)Observatory_init},
+    {Py_tp_new,     (void*)PyType_GenericNew},
+    {Py_tp_dealloc, (void*)heap_dealloc},
+    {0, NULL}
+};
+
+static PyType_Spec Observatory_spec = {
+    "_sla.Observatory", sizeof(Observatory), 0, SLA_TYPE_FLAGS, Observatory_slots
+};
+
+// Creates the types of module m, storing them in its state and adding them
+// to it; called at module initialisation
+
+static int
+add_types(PyObject *m, Module_state *state)
+{
+    state->target_type = (PyTypeObject*) PyType_FromModuleAndSpec(m, &Target_spec, NULL);
+    if(state->target_type == NULL || PyModule_AddType(m, state->target_type) < 0) return -1;
+
+    state->observatory_type = (PyTypeObject*) PyType_FromModuleAndSpec(m, &Observatory_spec, NULL);
+    if(state->observatory_type == NULL || PyModule_AddType(m, state->observatory_type) < 0) return -1;
+
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+// Night tables
+
+// Field names of the structured arrays returned by night_table
+
+static const char *NIGHT_FIELDS[] = {"mjd", "midnight", "sunset", "dusk", "dawn", "sunrise"};
+static const int NNIGHT = 6;
+static const char *EVENT_FIELDS[] = {"rise", "transit", "set", "alt_transit", "alt_max"};
+static const int NEVENT = 5;
+
+// Returns a new array of shape dims with named float64 fields, or NULL
+// with an exception set.
+
+static PyArrayObject*
+new_record_array(int nd, npy_intp *dims, int nfield, const char **fields)
+{
+    PyObject *list = PyList_New(nfield);
+    if(list == NULL) return NULL;
+    for(int i=0; i<nfield; i++)
+        PyList_SET_ITEM(list, i, Py_BuildValue("(ss)", fields[i], "f8"));
+    if(PyErr_Occurred()){
+        Py_DECREF(list);
+        return NULL;
+    }
+
+    PyArray_Descr *descr;
+    int ok = PyArray_DescrConverter(list, &descr);
+    Py_DECREF(list);
+    if(!ok) return NULL;
+    return (PyArrayObject*) PyArray_SimpleNewFromDescr(nd, dims, descr);
+}
+
+// Computes the events of one night for one target given the night's times
+// (in the order of NIGHT_FIELDS) and mean-to-observed parameters computed
+// at midnight, to which only the sidereal time is updated (slaAoppat). Over
+// half a day the neglected changes in aberration, precession and nutation
+// are a few tenths of an arcsec; this is what makes it cheap to handle many
+// targets. The transit nearest midnight is found by correcting the hour
+// angle twice; rise and set are the crossings of alt on either side of it.
+
+static void
+night_events(const double *night, const Site& site, const Star& star, const Atmosphere& atmos,
+             const Apparent& mid, double alt, double acc, double *events)
+{
+    // sidereal to solar day
+    const double SIDEREAL = 1.00273790935;
+
+    auto observe = [&](double utc, Amass_result& res){
+        Apparent app(mid);
+        slaAoppat(utc, app.aoprms);
+        amass_star(slaEpj(utc), site, star, atmos, app, res);
+    };
+
+    Amass_result res;
+    double transit = night[1];
+    for(int i=0; i<3; i++){
+        observe(transit, res);
+        double ha = res.ha > 12. ? res.ha - 24. : (res.ha < -12. ? res.ha + 24. : res.ha);
+        transit -= ha/24./SIDEREAL;
+    }
+    observe(transit, res);
+    double alt_transit = res.alt;
+
+    auto above = [&](double utc){
+        Amass_result r;
+        observe(utc, r);
+        return r.alt - alt;
+    };
+    const double HALF = 0.5/SIDEREAL;
+    events[0] = illinois(above, transit-HALF, transit, acc);
+    events[1] = transit;
+    events[2] = illinois(above, transit, transit+HALF, acc);
+    events[3] = alt_transit;
+
+    // highest altitude between dusk and dawn
+    double dusk = night[3], dawn = night[4];
+    if(std::isfinite(dusk) && std::isfinite(dawn)){
+        if(transit >= dusk && transit <= dawn){
+            events[4] = alt_transit;
+        }else{
+            observe(dusk, res);
+            events[4] = res.alt;
+            observe(dawn, res);
+            events[4] = std::max(events[4], res.alt);
+        }
+    }else{
+        events[4] = NAN;
+    }
+}
+
+// Computes rise, set and twilight times for many nights and targets
 
 static PyObject* 
-sla_utc2tdb(PyObject *self, PyObject *args)
+sla_night_table(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *iutc = NULL;
-    double ra, dec, longitude, latitude, height;
-    double pmra = 0., pmdec = 0., epoch = 2000., parallax = 0., rv = 0.;
-    if(!PyArg_ParseTuple(args, "Oddddd|ddddd:sla.utc2tdb", 
-			 &iutc, &longitude, &latitude, &height, &ra, &dec, 
-			 &pmra, &pmdec, &epoch, &parallax, &rv))
+
+    PyObject *osite = NULL, *targets = NULL;
+    int mjd, ndays, nthreads = 1;
+    double alt = 30., twilight = -18., horizon = -0.25, acc = 1.e-5;
+    static const char *kwlist[] = {"site", "mjd", "ndays", "targets", "alt", "twilight", 
+                                   "horizon", "acc", "nthreads", NULL};
+    Module_state *state = module_state(self);
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!iiO|ddddi:sla.night_table", 
+                                    const_cast<char**>(kwlist), state->observatory_type, &osite,
+                                    &mjd, &ndays, &targets, &alt, &twilight, &horizon, 
+                                    &acc, &nthreads))
 	return NULL;
 
-    // Some checks on the inputs
-    npy_intp nutc = 0;
-    double vutc = 0.;
-    if(iutc){
-        if(PyFloat_Check(iutc)){
-            vutc = PyFloat_AsDouble(iutc);
-            if(PyErr_Occurred()){
-                PyErr_SetString(PyExc_ValueError, "sla.amass: could not translate utc value");
-                return NULL;
+    if(ndays < 1){
+        PyErr_SetString(PyExc_ValueError, "sla.night_table: ndays must be at least 1");
+        return NULL;
+    }
+
+    std::vector<Star> stars;
+    if(!get_stars("sla.night_table", state->target_type, targets, stars))
+        return NULL;
+
+    Observatory *obs = (Observatory*)osite;
+    Site site;
+    Atmosphere atmos;
+    observatory_get(obs, site, atmos);
+    npy_intp nstar = stars.size();
+
+    npy_intp ndim[1] = {ndays}, edim[2] = {ndays, nstar};
+    PyArrayObject *nights = new_record_array(1, ndim, NNIGHT, NIGHT_FIELDS);
+    if(nights == NULL) return NULL;
+    PyArrayObject *events = new_record_array(2, edim, NEVENT, EVENT_FIELDS);
+    if(events == NULL){
+        Py_DECREF(nights);
+        return NULL;
+    }
+    double *nptr = (double*) PyArray_DATA(nights);
+    double *eptr = (double*) PyArray_DATA(events);
+
+    // longitude in days, from the copied site so that it matches the rest
+    double dlong = site.longr/Constants::TWOPI;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    // The Sun. Night i runs from local mean noon on MJD mjd+i to the next.
+    std::vector<Apparent> mids(ndays, Apparent(site, atmos, &state->caches->aoppa));
+    parallel_for(ndays, nthreads, [&](npy_intp i1, npy_intp i2){
+            for(npy_intp i=i1; i<i2; i++){
+                double *night = nptr + NNIGHT*i;
+                double noon   = mjd + i + 0.5 - dlong;
+                night[0] = mjd + i;
+                night[1] = noon + 0.5;
+                night[2] = sun_root_point(noon, night[1], horizon, site, atmos, false, NULL, NULL, acc);
+                night[3] = sun_root_point(noon, night[1], twilight, site, atmos, false, NULL, NULL, acc);
+                night[4] = sun_root_point(night[1], noon+1., twilight, site, atmos, false, NULL, NULL, acc);
+                night[5] = sun_root_point(night[1], noon+1., horizon, site, atmos, false, NULL, NULL, acc);
+                mids[i].update(night[1]);
             }
-            nutc = 1;
-        }else if(PyArray_Check(iutc)){
-            int nd = PyArray_NDIM(iutc);
-            if(nd != 1){
-                PyErr_SetString(PyExc_ValueError, "sla.amass: utc must be a 1D array or a float");
-                return NULL;
+        });
+
+    // The targets
+    parallel_for(ndays*nstar, nthreads, [&](npy_intp k1, npy_intp k2){
+            for(npy_intp k=k1; k<k2; k++){
+                npy_intp i = k / nstar, j = k % nstar;
+                night_events(nptr + NNIGHT*i, site, stars[j], atmos, mids[i], alt, acc, 
+                             eptr + NEVENT*k);
             }
-        }else{
-            PyErr_SetString(PyExc_TypeError, "sla.amass: utc must be a 1D array or a float");
-            return NULL;
+        });
+
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("NN", nights, events);
+};
+
+// An interval of utc, MJD
+
+typedef std::pair<double,double> Interval;
+
+// Appends [t1,t2] to a time-ordered list of intervals, merging it with the
+// last if they touch
+
+static void
+add_interval(std::vector<Interval>& list, double t1, double t2)
+{
+    if(!(t2 > t1)) return;
+    if(!list.empty() && t1 <= list.back().second)
+        list.back().second = std::max(list.back().second, t2);
+    else
+        list.push_back(Interval(t1, t2));
+}
+
+// Finds the intervals within dark, the time-ordered periods when the Sun is
+// below the limit during one night, when a target is above observed
+// altitude alt, appending them to vis. mid holds the mean-to-observed
+// parameters at midnight, as for night_events. The transit nearest midnight
+// is found as in night_events, and with it the declination which gives the
+// hour angle at which alt is crossed from the slaDe2h geometry, cos(H) =
+// (sin(alt) - sin(lat) sin(dec))/(cos(lat) cos(dec)). Only the crossings
+// which fall within dark are refined, each by root-finding over ten minutes
+// either side of the estimate, which covers the neglect of refraction and
+// the drift in ra, with the full half day searched as a fall back. This,
+// together with the transits either side, handles targets that set after
+// dusk and rise again before dawn.
+
+static void
+target_windows(const std::vector<Interval>& dark, const Site& site, const Star& star,
+               const Atmosphere& atmos, const Apparent& mid, double midnight, double alt,
+               double acc, std::vector<Interval>& vis)
+{
+    const double SIDEREAL = 1.00273790935;
+    const double CFAC     = Constants::PI/180.;
+    const double HALF     = 0.5/SIDEREAL;
+    const double MARGIN   = 10./1440.;
+
+    auto observe = [&](double utc, Amass_result& res){
+        Apparent app(mid);
+        slaAoppat(utc, app.aoprms);
+        amass_star(slaEpj(utc), site, star, atmos, app, res, 0);
+    };
+
+    Amass_result res;
+    double transit = midnight;
+    for(int i=0; i<3; i++){
+        observe(transit, res);
+        double ha = res.ha > 12. ? res.ha - 24. : (res.ha < -12. ? res.ha + 24. : res.ha);
+        transit -= ha/24./SIDEREAL;
+    }
+    observe(transit, res);
+
+    // never reaches alt
+    if(!(res.alt > alt)) return;
+
+    // declination from the observed zenith distance at transit
+    double zd   = (90.-res.alt)*CFAC;
+    double decr = site.latr + zd*cos(res.az*CFAC);
+    double cos_h = (sin(alt*CFAC) - sin(site.latr)*sin(decr))/(cos(site.latr)*cos(decr));
+
+    // always above alt
+    if(cos_h <= -1.){
+        for(size_t n=0; n<dark.size(); n++)
+            add_interval(vis, dark[n].first, dark[n].second);
+        return;
+    }
+
+    double hwidth = std::acos(std::min(cos_h, 1.))/Constants::TWOPI/SIDEREAL;
+
+    auto above = [&](double utc){
+        Amass_result r;
+        observe(utc, r);
+        return r.alt - alt;
+    };
+
+    auto refine = [&](double estimate, double t1, double t2){
+        double t = illinois(above, estimate-MARGIN, estimate+MARGIN, acc);
+        return std::isfinite(t) ? t : illinois(above, t1, t2, acc);
+    };
+
+    for(int k=-1; k<=1; k++){
+        double tk = transit + k/SIDEREAL;
+        double rise = tk - hwidth, set = tk + hwidth;
+        for(size_t n=0; n<dark.size(); n++){
+            double d1 = dark[n].first, d2 = dark[n].second;
+            if(set <= d1 || rise >= d2) continue;
+            double t1 = rise > d1 ? refine(rise, tk-HALF, tk) : d1;
+            double t2 = set  < d2 ? refine(set, tk, tk+HALF) : d2;
+            if(std::isfinite(t1) && std::isfinite(t2))
+                add_interval(vis, std::max(t1, d1), std::min(t2, d2));
         }
-    }else{
-        PyErr_SetString(PyExc_ValueError, "sla.amass: utc not defined");
-        return NULL;
     }
+}
+
+// Finds when targets are observable
+
+static PyObject* 
+sla_visibility_windows(PyObject *self, PyObject *args, PyObject *kwds)
+{
 
-    if(longitude < -360. || longitude > +360.){
-	PyErr_SetString(PyExc_ValueError, "sla.utc2tdb: longituge out of range -360 to +360");
+    PyObject *osite = NULL, *targets = NULL;
+    double utc1, utc2, airmass = 2., sun_alt = -12., acc = 1.e-5;
+    int nthreads = 1;
+    static const char *kwlist[] = {"site", "utc1", "utc2", "targets", "airmass", "sun_alt", 
+                                   "acc", "nthreads", NULL};
+    Module_state *state = module_state(self);
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!ddO|dddi:sla.visibility_windows", 
+                                    const_cast<char**>(kwlist), state->observatory_type, &osite,
+                                    &utc1, &utc2, &targets, &airmass, &sun_alt, &acc, &nthreads))
 	return NULL;
-    }
 
-    if(latitude < -90. || latitude > +90.){
-	PyErr_SetString(PyExc_ValueError, "sla.utc2tdb: latitude out of range -90 to +90");
-	return NULL;
+    if(!(utc2 > utc1) || utc2 - utc1 > 100000.){
+        PyErr_SetString(PyExc_ValueError, "sla.visibility_windows: utc2 must exceed utc1 by up to 100000 days");
+        return NULL;
     }
 
-    if(ra < 0. || ra > 24.){
-	PyErr_SetString(PyExc_ValueError, "sla.utc2tdb: ra out of range 0 to 24");
-	return NULL;
+    // slaAirmas stops changing at a zenith distance of 1.52 radians
+    const double ZDMAX = 1.52;
+    if(!(airmass >= 1.) || airmass > slaAirmas(ZDMAX)){
+        PyErr_SetString(PyExc_ValueError, ("sla.visibility_windows: airmass out of range 1 to " + 
+                                           Subs::str(slaAirmas(ZDMAX))).c_str());
+        return NULL;
     }
 
-    if(dec < -90. || dec > +90.){
-	PyErr_SetString(PyExc_ValueError, "sla.utc2tdb: declination out of range -90 to +90");
-	return NULL;
-    }
+    std::vector<Star> stars;
+    if(!get_stars("sla.visibility_windows", state->target_type, targets, stars))
+        return NULL;
 
-    // convert angles to those expected by sla routines
-    const double CFAC = Constants::PI/180.;
-    double latr   = CFAC*latitude;
-    double longr  = CFAC*longitude;
-    double rar    = CFAC*15.*ra;
-    double decr   = CFAC*dec;
-    double pmrar  = CFAC*pmra/3600.;
-    double pmdecr = CFAC*pmdec/3600.;
-
-    double u, v;
-    slaGeoc( latr, height, &u, &v);
-    u *= Constants::AU/1000.0;
-    v *= Constants::AU/1000.0;
-    if(nutc){
-        double tt  = vutc + slaDtt(vutc)/Constants::DAY;
-        double tdb = tt  + slaRcc(tt, vutc-int(vutc), -longr, u, v)/Constants::DAY;
-
-        // Compute position of Earth relative to the centre of the Sun and
-        // the barycentre
-        double ph[3], pb[3], vh[3], vb[3];
-        slaEpv(tdb, ph, vh, pb, vb);
-        
-        // Create 3 vectors for simplicity of code
-        Subs::Vec3 hpos(ph), bpos(pb), hvel(vh), bvel(vb);
-        
-        // Calculate correction from centre of Earth to observatory
-        double last = slaGmst(tdb) + longr + slaEqeqx(tdb);
-        double pv[6];
-        slaPvobs(latr, height, last, pv);
-
-        // Correct for precession/nutation
-        double rnpb[3][3];
-        slaPneqx(tdb, rnpb);
-        slaDimxv(rnpb, pv, pv);
-        slaDimxv(rnpb, pv+3, pv+3);
-
-        Subs::Vec3 padd(pv), vadd(pv+3);
-
-        // heliocentric
-        hpos += padd;
-        hpos *= Constants::AU;
-        hvel += Constants::DAY*vadd;
-        hvel *= Constants::AU/Constants::DAY;
-
-        // barycentric
-        bpos += padd;
-        bpos *= Constants::AU;
-        bvel += Constants::DAY*vadd;
-        bvel *= Constants::AU/Constants::DAY;
-
-        // At this point 'hpos' and 'bpos' contains the position of the
-        // observatory on the BCRS reference frame in metres relative to the
-        // helio- and barycentres. Now update the target position using space
-        // motion data.
-        double nepoch = slaEpj(vutc);
-        slaPm(rar, decr, pmrar, pmdecr, parallax, rv, epoch, nepoch, &rar, &decr);
-
-        // Compute position vector of target
-        double tv[3];
-        slaDcs2c(rar, decr, tv);
-        Subs::Vec3 targ(tv);
-
-        // Finally, the helio- and barycentrically corrected times 
-        double hcorr = dot(targ, hpos)/Constants::C/Constants::DAY;
-        double bcorr = dot(targ, bpos)/Constants::C/Constants::DAY;
-
-        double btdb  = tdb + bcorr;
-        double htdb  = tdb + hcorr;
-        double hutc  = vutc + hcorr;
-
-        // and the radial velocities
-        double vhel = -dot(targ, hvel)/1000.;
-        double vbar = -dot(targ, bvel)/1000.;
-        return Py_BuildValue("ddddddd", tt, tdb, btdb, hutc, htdb, vhel, vbar);
+    Observatory *obs = (Observatory*)osite;
+    Site site;
+    Atmosphere atmos;
+    observatory_get(obs, site, atmos);
+    npy_intp nstar = stars.size();
 
-    }else{
+    // altitude equivalent to the airmass limit
+    double alt = 90. - illinois([=](double zd){return slaAirmas(zd)-airmass;}, 0., ZDMAX, 1.e-10)*180./Constants::PI;
 
-        // An array has been passed, lots of painful setup ...
-        nutc = PyArray_Size(iutc);
-        PyObject *arr = PyArray_FROM_OTF(iutc, NPY_DOUBLE, NPY_IN_ARRAY);
-        if(arr == NULL) return NULL;
-        double *utc = (double *)PyArray_DATA(arr);
+    // Night i runs from local mean noon, the first on or before utc1
+    double dlong  = site.longr/Constants::TWOPI;
+    double noon0  = std::floor(utc1 - 0.5 + dlong) + 0.5 - dlong;
+    npy_intp ndays = npy_intp(std::ceil(utc2 - noon0));
+    std::vector<double> midnight(ndays);
+    std::vector<std::vector<Interval> > dark(ndays), vis(nstar);
 
-        npy_intp dim[1] = {nutc};
-        PyArrayObject *ott = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(ott == NULL){
-            Py_DECREF(arr);
-            return NULL;
-        }
-        PyArrayObject *otdb = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(otdb == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(ott);
-            return NULL;
-        }
-        PyArrayObject *obtdb = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(obtdb == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(ott);
-            Py_DECREF(otdb);
-            return NULL;
-        }
-        PyArrayObject *ohutc = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(ohutc == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(ott);
-            Py_DECREF(otdb);
-            Py_DECREF(obtdb);
-            return NULL;
-        }
-        PyArrayObject *ohtdb = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(ohtdb == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(ott);
-            Py_DECREF(otdb);
-            Py_DECREF(obtdb);
-            Py_DECREF(ohutc);
-            return NULL;
-        }
-        PyArrayObject *ovhel = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(ovhel == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(ott);
-            Py_DECREF(otdb);
-            Py_DECREF(obtdb);
-            Py_DECREF(ohutc);
-            Py_DECREF(ohtdb);
+    Py_BEGIN_ALLOW_THREADS
+
+    // The Sun
+    std::vector<Apparent> mids(ndays, Apparent(site, atmos, &state->caches->aoppa));
+    parallel_for(ndays, nthreads, [&](npy_intp i1, npy_intp i2){
+            Sun_result res;
+            for(npy_intp i=i1; i<i2; i++){
+                double noon = noon0 + i;
+                midnight[i] = noon + 0.5;
+                mids[i].update(midnight[i]); 
+
+                // the Sun is assumed lowest at midnight
+                sun_point(midnight[i], site, atmos, false, NULL, NULL, res);
+                if(res.el >= sun_alt) continue;
+                double dusk = sun_root_point(noon, midnight[i], sun_alt, site, atmos, false, NULL, NULL, acc);
+                double dawn = sun_root_point(midnight[i], noon+1., sun_alt, site, atmos, false, NULL, NULL, acc);
+                if(!std::isfinite(dusk)) dusk = noon;
+                if(!std::isfinite(dawn)) dawn = noon + 1.;
+                add_interval(dark[i], std::max(dusk, utc1), std::min(dawn, utc2));
+            }
+        });
+
+    // The targets
+    parallel_for(nstar, nthreads, [&](npy_intp j1, npy_intp j2){
+            for(npy_intp j=j1; j<j2; j++){
+                for(npy_intp i=0; i<ndays; i++){
+                    if(!dark[i].empty())
+                        target_windows(dark[i], site, stars[j], atmos, mids[i], midnight[i], alt, acc, vis[j]);
+                }
+            }
+        });
+
+    Py_END_ALLOW_THREADS
+
+    PyObject *list = PyList_New(nstar);
+    if(list == NULL) return NULL;
+    for(npy_intp j=0; j<nstar; j++){
+        npy_intp dims[2] = {npy_intp(vis[j].size()), 2};
+        PyArrayObject *arr = (PyArrayObject*) PyArray_SimpleNew(2, dims, NPY_DOUBLE);
+        if(arr == NULL){
+            Py_DECREF(list);
             return NULL;
         }
-        PyArrayObject *ovbar = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(ovbar == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(ott);
-            Py_DECREF(otdb);
-            Py_DECREF(obtdb);
-            Py_DECREF(ohutc);
-            Py_DECREF(ohtdb);
-            Py_DECREF(ovhel);
-            return NULL;
+        double *ptr = (double*) PyArray_DATA(arr);
+        for(size_t n=0; n<vis[j].size(); n++){
+            ptr[2*n]   = vis[j][n].first;
+            ptr[2*n+1] = vis[j][n].second;
         }
-        
-        // data pointers
-        double *tt    = (double*) ott->data;
-        double *tdb   = (double*) otdb->data;
-        double *btdb  = (double*) obtdb->data;
-        double *hutc  = (double*) ohutc->data;
-        double *htdb  = (double*) ohtdb->data;
-        double *vhel  = (double*) ovhel->data;
-        double *vbar  = (double*) ovbar->data;
-        
-        for(int i=0; i<nutc; i++){
-            tt[i]  = utc[i] + slaDtt(utc[i])/Constants::DAY;
-            tdb[i] = tt[i]  + slaRcc(tt[i], utc[i]-int(utc[i]), -longr, u, v)/Constants::DAY;
-
-            // Compute position of Earth relative to the centre of the Sun and
-            // the barycentre
-            double ph[3], pb[3], vh[3], vb[3];
-            slaEpv(tdb[i], ph, vh, pb, vb);
-        
-            // Create 3 vectors for simplicity of code
-            Subs::Vec3 hpos(ph), bpos(pb), hvel(vh), bvel(vb);
-        
-            // Calculate correction from centre of Earth to observatory
-            double last = slaGmst(tdb[i]) + longr + slaEqeqx(tdb[i]);
-            double pv[6];
-            slaPvobs(latr, height, last, pv);
-
-            // Correct for precession/nutation
-            double rnpb[3][3];
-            slaPneqx(tdb[i], rnpb);
-            slaDimxv(rnpb, pv, pv);
-            slaDimxv(rnpb, pv+3, pv+3);
-
-            Subs::Vec3 padd(pv), vadd(pv+3);
-
-            // heliocentric
-            hpos += padd;
-            hpos *= Constants::AU;
-            hvel += Constants::DAY*vadd;
-            hvel *= Constants::AU/Constants::DAY;
-
-            // barycentric
-            bpos += padd;
-            bpos *= Constants::AU;
-            bvel += Constants::DAY*vadd;
-            bvel *= Constants::AU/Constants::DAY;
-
-            // At this point 'hpos' and 'bpos' contains the position of the
-            // observatory on the BCRS reference frame in metres relative to
-            // the helio- and barycentres. Now update the target position
-            // using space motion data.
-            double nepoch = slaEpj(utc[i]);
-            slaPm(rar, decr, pmrar, pmdecr, parallax, rv, epoch, nepoch, &rar, &decr);
+        PyList_SET_ITEM(list, j, (PyObject*)arr);
+    }
+    return list;
+};
+
+//----------------------------------------------------------------------------------------
+// Batches of small jobs. run_batch takes many independent scalar utc2tdb,
+// amass and sun calls, as from a server handling many small requests, and
+// sorts them into groups sharing a site, atmosphere and kind, in time order,
+// so that the set-up work is shared as it is for arrays: the observer state
+// for equal utcs and the mean-to-observed parameters over REFRESH. The
+// groups are then computed in parallel without the GIL.
 
-            // Compute position vector of target
-            double tv[3];
-            slaDcs2c(rar, decr, tv);
-            Subs::Vec3 targ(tv);
-        
-            // Finally, the helio- and barycentrically corrected times 
-            double hcorr = dot(targ, hpos)/Constants::C/Constants::DAY;
-            double bcorr = dot(targ, bpos)/Constants::C/Constants::DAY;
-        
-            btdb[i]  = tdb[i] + bcorr;
-            htdb[i]  = tdb[i] + hcorr;
-            hutc[i]  = utc[i] + hcorr;
-        
-            // and the radial velocities
-            vhel[i] = -dot(targ, hvel)/1000.;
-            vbar[i] = -dot(targ, bvel)/1000.;
+enum Job_kind {JOB_UTC2TDB, JOB_AMASS, JOB_SUN, NJOB_KIND};
+static const char *JOB_NAMES[NJOB_KIND] = {"utc2tdb", "amass", "sun"};
+static const int JOB_NOUT[NJOB_KIND]    = {NTDB, NAMASS, 5};
 
-        }
+struct Job {
+    Job_kind kind;
+    double utc;
+    double key[6]; // longitude, latitude, height, wave, rh, fast: jobs are grouped on these
+    Site site;
+    Star star;
+    Atmosphere atmos;
+    bool fast;
+    double vals[NTDB];
+};
+
+// Order of the jobs to compute them in
+
+static bool
+job_order(const Job& a, const Job& b)
+{
+    if(a.kind != b.kind) return a.kind < b.kind;
+    for(int i=0; i<6; i++)
+        if(a.key[i] != b.key[i]) return a.key[i] < b.key[i];
+    return a.utc < b.utc;
+}
+
+static bool
+same_group(const Job& a, const Job& b)
+{
+    return a.kind == b.kind && std::equal(a.key, a.key+6, b.key);
+}
+
+// Converts one job, a (name, args) pair with args as for the scalar form of
+// the module function of that name (without keywords). Returns false with an
+// exception set on failure.
 
-        Py_DECREF(arr);
+static bool
+parse_job(PyObject *item, Job& job)
+{
+    const char *name;
+    PyObject *jargs;
+    if(!PyArg_ParseTuple(item, "sO!:sla.run_batch", &name, &PyTuple_Type, &jargs))
+        return false;
 
-        return Py_BuildValue("OOOOOOO", ott, otdb, obtdb, ohutc, ohtdb, ovhel, ovbar);
+    double lon, lat, height, ra = 0., dec = 0., wave = 0.55, rh = 0.2;
+    double pmra = 0., pmdec = 0., epoch = 2000., parallax = 0., rv = 0.;
+    int fast = 1;
+    if(std::strcmp(name, "utc2tdb") == 0){
+        job.kind = JOB_UTC2TDB;
+        if(!PyArg_ParseTuple(jargs, "dddddd|ddddd:sla.run_batch utc2tdb", &job.utc, &lon, &lat, &height,
+                             &ra, &dec, &pmra, &pmdec, &epoch, &parallax, &rv))
+            return false;
+    }else if(std::strcmp(name, "amass") == 0){
+        job.kind = JOB_AMASS;
+        if(!PyArg_ParseTuple(jargs, "dddddd|dddddd:sla.run_batch amass", &job.utc, &lon, &lat, &height,
+                             &ra, &dec, &wave, &pmra, &pmdec, &epoch, &parallax, &rv))
+            return false;
+    }else if(std::strcmp(name, "sun") == 0){
+        job.kind = JOB_SUN;
+        if(!PyArg_ParseTuple(jargs, "dddd|ddi:sla.run_batch sun", &job.utc, &lon, &lat, &height,
+                             &wave, &rh, &fast))
+            return false;
+    }else{
+        PyErr_SetString(PyExc_ValueError, (std::string("sla.run_batch: unrecognised job = ") + name).c_str());
+        return false;
     }
+    job.fast = fast != 0;
 
-};
+    if(!set_site("sla.run_batch", lon, lat, height, job.site))
+        return false;
+    if(job.kind != JOB_UTC2TDB && !set_atmos("sla.run_batch", wave, rh, job.atmos))
+        return false;
+    if(job.kind != JOB_SUN && !set_star("sla.run_batch", ra, dec, pmra, pmdec, epoch, parallax, rv, job.star))
+        return false;
 
-// Computes observational parameters such as airmass, altititude and elevation
+    const double key[6] = {lon, lat, height, wave, rh, double(fast)};
+    std::copy(key, key+6, job.key);
+    return true;
+}
 
-static PyObject* 
-sla_amass(PyObject *self, PyObject *args)
+// Computes jobs ordered with job_order, all of one group
+
+static void
+run_jobs(Caches& caches, Job *jobs, npy_intp n)
 {
+    if(n == 0) return;
+    const Site& site        = jobs[0].site;
+    const Atmosphere& atmos = jobs[0].atmos;
 
-    PyObject *iutc = NULL;
-    double ra, dec, longitude, latitude, height;
-    double wave=0.55, pmra = 0., pmdec = 0., epoch = 2000., parallax = 0., rv = 0.;
-    if(!PyArg_ParseTuple(args, "Oddddd|dddddd:sla.amass", 
-			 &iutc, &longitude, &latitude, &height, &ra, &dec, 
-			 &wave, &pmra, &pmdec, &epoch, &parallax, &rv))
-	return NULL;
+    if(jobs[0].kind == JOB_UTC2TDB){
+        Observer_state obs;
+        Tdb_result res;
+        for(npy_intp i=0; i<n; i++){
+            if(i == 0 || jobs[i].utc != jobs[i-1].utc)
+                observer_state(jobs[i].utc, site, NULL, obs);
+            utc2tdb_star(obs, jobs[i].star, res);
+            result_values(res, jobs[i].vals);
+        }
 
-    // Some checks on the inputs
-    npy_intp nutc = 0;
-    double vutc = 0.;
-    if(iutc){
-        if(PyFloat_Check(iutc)){
-            vutc = PyFloat_AsDouble(iutc);
-            if(PyErr_Occurred()){
-                PyErr_SetString(PyExc_ValueError, "sla.amass: could not translate utc value");
-                return NULL;
-            }
-            nutc = 1;
-        }else if(PyArray_Check(iutc)){
-            int nd = PyArray_NDIM(iutc);
-            if(nd != 1){
-                PyErr_SetString(PyExc_ValueError, "sla.amass: utc must be a 1D array or a float");
-                return NULL;
-            }
-        }else{
-            PyErr_SetString(PyExc_TypeError, "sla.amass: utc must be a 1D array or a float");
-            return NULL;
+    }else if(jobs[0].kind == JOB_AMASS){
+        Apparent app(site, atmos, &caches.aoppa);
+        Amass_result res;
+        for(npy_intp i=0; i<n; i++){
+            amass_point(jobs[i].utc, site, jobs[i].star, atmos, app, res);
+            result_values(res, jobs[i].vals);
         }
+
     }else{
-        PyErr_SetString(PyExc_ValueError, "sla.amass: utc not defined");
-        return NULL;
+        Sun_result res;
+        for(npy_intp i=0; i<n; i++){
+            sun_point(jobs[i].utc, site, atmos, jobs[i].fast, NULL, NULL, res);
+            double *v = jobs[i].vals;
+            v[0] = res.az;
+            v[1] = res.el;
+            v[2] = res.refract;
+            v[3] = res.ra;
+            v[4] = res.dec;
+        }
     }
+}
 
-    if(longitude < -360. || longitude > +360.){
-	PyErr_SetString(PyExc_ValueError, "sla.amass: longituge out of range -360 to +360");
-	return NULL;
-    }
+// Computes a batch of jobs
 
-    if(latitude < -90. || latitude > +90.){
-	PyErr_SetString(PyExc_ValueError, "sla.amass: latitude out of range -90 to +90");
-	return NULL;
-    }
+static PyObject* 
+sla_run_batch(PyObject *self, PyObject *args, PyObject *kwds)
+{
 
-    if(ra < 0. || ra > 24.){
-	PyErr_SetString(PyExc_ValueError, "sla.amass: ra out of range 0 to 24");
+    PyObject *ojobs = NULL;
+    int nthreads = 1;
+    static const char *kwlist[] = {"jobs", "nthreads", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:sla.run_batch", const_cast<char**>(kwlist),
+                                    &ojobs, &nthreads))
 	return NULL;
-    }
 
-    if(dec < -90. || dec > +90.){
-	PyErr_SetString(PyExc_ValueError, "sla.amass: declination out of range -90 to +90");
-	return NULL;
-    }
+    PyObject *seq = PySequence_Fast(ojobs, "sla.run_batch: jobs must be a sequence");
+    if(seq == NULL) return NULL;
+    npy_intp njob = PySequence_Fast_GET_SIZE(seq);
 
-    if(wave <= 0. || wave > 1000000.){
-	PyErr_SetString(PyExc_ValueError, "sla.amass: declination out of range -90 to +90");
-	return NULL;
+    // Jobs which fail to convert get the exception as their result
+    std::vector<Job> jobs;
+    jobs.reserve(njob);
+    std::vector<npy_intp> index;
+    std::vector<PyObject*> errors(njob, (PyObject*)NULL);
+    for(npy_intp i=0; i<njob; i++){
+        Job job;
+        if(parse_job(PySequence_Fast_GET_ITEM(seq, i), job)){
+            jobs.push_back(job);
+            index.push_back(i);
+        }else{
+            PyObject *type, *value, *trace;
+            PyErr_Fetch(&type, &value, &trace);
+            PyErr_NormalizeException(&type, &value, &trace);
+            errors[i] = value;
+            Py_XDECREF(type);
+            Py_XDECREF(trace);
+        }
     }
+    Py_DECREF(seq);
 
-    // convert angles to those expected by sla routines
-    const double CFAC = Constants::PI/180.;
-    double latr   = CFAC*latitude;
-    double longr  = CFAC*longitude;
-    double rar    = CFAC*15.*ra;
-    double decr   = CFAC*dec;
-    double pmrar  = CFAC*pmra/3600.;
-    double pmdecr = CFAC*pmdec/3600.;
-
-    // first three small corrections factors are assumed zero for ease of use
-    const double DUT  = 0.; // UT1-UTC, seconds
-    const double XP   = 0.; // polar motion, radians
-    const double YP   = 0.; // polar motion, radians
-    const double T    = 285.; // ambient temperature K
-    const double P    = 1013.25; // ambient pressure, mbar
-    const double RH   = 0.2;     // relative humidity (0-1)
-    const double TLR  = 0.0065;  // lapse rate, K/metre
-
-    double nepoch, zdob, decob, raob, refa, refb, tanz;
-     
-    if(nutc){
-        // A single utc has been passed and we will return floats.
-        double vazob, vhaob, vdelz, valtob, vairmass, vpaob;
-
-        // correct for space motion
-        nepoch = slaEpj(vutc);
-        slaPm(rar, decr, pmrar, pmdecr, parallax, rv, epoch, nepoch, &rar, &decr);
-            
-        // *observed* azimuth (N->E), zenith distance, hour angle, declination, ra (all radians)
-        slaI2o(rar, decr, vutc, DUT, longr, latr, height, XP, YP, T, P, RH, wave, TLR, 
-               &vazob, &zdob, &vhaob, &decob, &raob);
-        
-        // compute refraction
-        slaRefcoq(T, P, RH, wave, &refa, &refb);
-        tanz = tan(zdob);
-        vdelz = tanz*(refa + refb*tanz*tanz)/CFAC;
-            
-        // convert units
-        valtob   = 90.-zdob/CFAC;
-        vairmass = slaAirmas(zdob); 
-        vazob   /= CFAC;
-            
-        // Compute pa
-        vpaob = slaPa(vhaob,decr,latr)/CFAC;
-        vpaob = vpaob > 0. ? vpaob : 360.+vpaob;
-            
-        vhaob *= 24./Constants::TWOPI;
+    npy_intp nok = jobs.size();
+    std::vector<npy_intp> order(nok);
+    for(npy_intp i=0; i<nok; i++) order[i] = i;
 
-        // return  airmass, altitude (deg), azimuth (deg, N=0, E=90),
-        // hour angle, parallactic angle, angle of refraction
-        return Py_BuildValue("dddddd", vairmass, valtob, vazob, vhaob, vpaob, vdelz);
+    Caches& caches = *module_state(self)->caches;
 
-    }else{
+    Py_BEGIN_ALLOW_THREADS
 
-        // An array has been passed, lots of painful setup ...
-        nutc = PyArray_Size(iutc);
-        PyObject *arr = PyArray_FROM_OTF(iutc, NPY_DOUBLE, NPY_IN_ARRAY);
-        if(arr == NULL) return NULL;
-        double *utc = (double *)PyArray_DATA(arr);
+    // sort then split into groups, with large groups cut into chunks as the
+    // unit of parallel work
+    std::sort(order.begin(), order.end(), [&](npy_intp a, npy_intp b){
+            return job_order(jobs[a], jobs[b]);
+        });
+    std::vector<Job> sorted(nok);
+    for(npy_intp i=0; i<nok; i++) sorted[i] = jobs[order[i]];
 
-        npy_intp dim[1] = {nutc};
-        PyArrayObject *oair = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(oair == NULL){
-            Py_DECREF(arr);
-            return NULL;
-        }
-        PyArrayObject *oalt = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(oalt == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(oair);
-            return NULL;
-        }
-        PyArrayObject *oaz = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(oaz == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(oair);
-            Py_DECREF(oalt);
-            return NULL;
-        }
-        PyArrayObject *oha = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(oha == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(oair);
-            Py_DECREF(oalt);
-            Py_DECREF(oaz);
-            return NULL;
-        }
-        PyArrayObject *opa = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(opa == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(oair);
-            Py_DECREF(oalt);
-            Py_DECREF(oaz);
-            Py_DECREF(oha);
-            return NULL;
+    const npy_intp CHUNK = 4096;
+    std::vector<npy_intp> starts;
+    for(npy_intp i=0; i<nok; i++)
+        if(i == 0 || !same_group(sorted[i], sorted[i-1]) || i - starts.back() == CHUNK)
+            starts.push_back(i);
+    starts.push_back(nok);
+
+    parallel_for(npy_intp(starts.size())-1, nthreads, [&](npy_intp k1, npy_intp k2){
+            for(npy_intp k=k1; k<k2; k++)
+                run_jobs(caches, &sorted[starts[k]], starts[k+1]-starts[k]);
+        });
+
+    for(npy_intp i=0; i<nok; i++) jobs[order[i]] = sorted[i];
+
+    Py_END_ALLOW_THREADS
+
+    PyObject *results = PyList_New(njob);
+    if(results == NULL){
+        for(npy_intp i=0; i<njob; i++)
+            Py_XDECREF(errors[i]);
+        return NULL;
+    }
+    for(npy_intp i=0; i<njob; i++)
+        if(errors[i]) PyList_SET_ITEM(results, i, errors[i]);
+    for(npy_intp n=0; n<nok; n++){
+        const Job& job = jobs[n];
+        PyObject *tuple = PyTuple_New(JOB_NOUT[job.kind]);
+        if(tuple){
+            for(int k=0; k<JOB_NOUT[job.kind]; k++)
+                PyTuple_SET_ITEM(tuple, k, PyFloat_FromDouble(job.vals[k]));
         }
-        PyArrayObject *odelz = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-        if(odelz == NULL){
-            Py_DECREF(arr);
-            Py_DECREF(oair);
-            Py_DECREF(oalt);
-            Py_DECREF(oaz);
-            Py_DECREF(oha);
-            Py_DECREF(opa);
+        if(tuple == NULL || PyErr_Occurred()){
+            Py_XDECREF(tuple);
+            Py_DECREF(results);
             return NULL;
         }
-        
-        // data pointers
-        double *airmass = (double*) oair->data;
-        double *altob   = (double*) oalt->data;
-        double *azob    = (double*) oaz->data;
-        double *haob    = (double*) oha->data;
-        double *paob    = (double*) opa->data;
-        double *delz    = (double*) odelz->data;
-        
-        for(int i=0; i<nutc; i++){
-            // correct for space motion
-            nepoch = slaEpj(utc[i]);
-            slaPm(rar, decr, pmrar, pmdecr, parallax, rv, epoch, nepoch, &rar, &decr);
-            
-            // *observed* azimuth (N->E), zenith distance, hour angle, declination, ra (all radians)
-            slaI2o(rar, decr, utc[i], DUT, longr, latr, height, XP, YP, T, P, RH, wave, TLR, 
-                   &azob[i], &zdob, &haob[i], &decob, &raob);
-            
-            // compute refraction
-            slaRefcoq(T, P, RH, wave, &refa, &refb);
-            tanz = tan(zdob);
-            delz[i] = tanz*(refa + refb*tanz*tanz)/CFAC;
-            
-            // convert units
-            altob[i]   = 90.-zdob/CFAC;
-            airmass[i] = slaAirmas(zdob); 
-            azob[i]   /= CFAC;
-            
-            // Compute pa
-            paob[i] = slaPa(haob[i],decr,latr)/CFAC;
-            paob[i] = paob[i] > 0. ? paob[i] : 360.+paob[i];
-            
-            haob[i] *= 24./Constants::TWOPI;
-        }
-
-        Py_DECREF(arr);
-
-        // return  airmass, altitude (deg), azimuth (deg, N=0, E=90),
-        // hour angle, parallactic angle, angle of refraction
-        return Py_BuildValue("OOOOOO", oair, oalt, oaz, oha, opa, odelz);
+        PyList_SET_ITEM(results, index[n], tuple);
     }
+    return results;
 };
 
+//----------------------------------------------------------------------------------------
+// NumPy ufuncs. These broadcast all of their arguments against each other,
+// so that for instance utc can be a column and ra, dec a row to give results
+// on a grid of times by targets, and they support out=, where= and the other
+// standard ufunc keywords. Each element is computed exactly as by the
+// corresponding function above except that invalid inputs give NaN outputs
+// rather than raising exceptions. The conversions of site, target and
+// atmosphere are only repeated when their values change from one element to
+// the next. NumPy releases the GIL while the loops run.
 
-// Computes position of the Sun
+// Returns input k or a reference to output k for element i of a ufunc loop
 
-static PyObject* 
-sla_sun(PyObject *self, PyObject *args)
+static inline double
+uf_in(char **args, const npy_intp *steps, int k, npy_intp i)
 {
+    return *(const double *)(args[k] + i*steps[k]);
+}
 
-    double utc, longitude, latitude, height, wave=0.55, rh=0.2;
-    int fast=1;
-    if(!PyArg_ParseTuple(args, "dddd|ddi:sla.sun", &utc, &longitude, &latitude, &height, &wave, &rh, &fast))
-	return NULL;
-
-    // Some checks on the inputs
-    if(longitude < -360. || longitude > +360.){
-	PyErr_SetString(PyExc_ValueError, "sla.sun: longituge out of range -360 to +360");
-	return NULL;
-    }
+static inline double&
+uf_out(char **args, const npy_intp *steps, int k, npy_intp i)
+{
+    return *(double *)(args[k] + i*steps[k]);
+}
 
-    if(latitude < -90. || latitude > +90.){
-	PyErr_SetString(PyExc_ValueError, "sla.sun: latitude out of range -90 to +90");
-	return NULL;
-    }
+// Sets outputs k1 to k2-1 of element i to NaN
 
-    if(wave <= 0. || wave > 1000000.){
-	PyErr_SetString(PyExc_ValueError, "sla.sun: declination out of range -90 to +90");
-	return NULL;
-    }
+static inline void
+uf_nan(char **args, const npy_intp *steps, int k1, int k2, npy_intp i)
+{
+    for(int k=k1; k<k2; k++)
+        uf_out(args, steps, k, i) = NAN;
+}
 
-    if(rh < 0. || rh > 1.){
-	PyErr_SetString(PyExc_ValueError, "sla.sun: relative humidity out of range 0 to 1");
-	return NULL;
-    }
+// Range checks matching those of set_site, set_star and set_atmos. NaNs
+// fail them.
 
-    // convert angles to those expected by sla routines
-    const double CFAC = Constants::PI/180.;
-    double latr   = CFAC*latitude;
-    double longr  = CFAC*longitude;
-    
-    // first three small corrections factors are assumed zero for ease of use
-    const double DUT  = 0.; // UT1-UTC, seconds
-    const double T    = 285.; // ambient temperature K
-    const double P    = 1013.25; // ambient pressure, mbar
-    const double TLR  = 0.0065;  // lapse rate, K/metre
+static inline bool
+site_ok(double longitude, double latitude)
+{
+    return longitude >= -360. && longitude <= 360. && latitude >= -90. && latitude <= 90.;
+}
 
-    // UT1
-    double ut1 = utc + DUT;
+static inline bool
+star_ok(double ra, double dec)
+{
+    return ra >= 0. && ra <= 24. && dec >= -90. && dec <= 90.;
+}
 
-    // TT
-    double tt = utc + slaDtt(utc)/Constants::DAY;
+static inline bool
+atmos_ok(double wave, double rh)
+{
+    return wave > 0. && wave <= 1000000. && rh >= 0. && rh <= 1.;
+}
 
-    // Compute position of Earth relative to the centre of the Sun and
-    // the barycentre
-    double ph[3], pb[3], vh[3], vb[3];
-    slaEvp(tt, -1., vb, pb, vh, ph);
-    
-    // Nutate
-    double rmatn[3][3], phn[3];
-    slaNut(tt, rmatn);
-    slaDmxv(rmatn, ph, phn);
+// utc, longitude, latitude, height, ra, dec, pmra, pmdec, epoch, parallax, rv
+// -> tt, tdb, btdb, hutc, htdb, vhel, vbar
 
-    // Calculate correction from centre of Earth to observatory
-    double last = slaGmst(ut1) + longr + slaEqeqx(tt);
-    double pv[6];
-    slaPvobs(latr, height, last, pv);
+static void
+utc2tdb_loop(char **args, npy_intp const *dimensions, npy_intp const *steps, void *data)
+{
+    Site site;
+    double lon = NAN, lat = NAN, height = NAN;
+    Tdb_result res;
+    for(npy_intp i=0; i<dimensions[0]; i++){
+        double x[11];
+        for(int k=0; k<11; k++) x[k] = uf_in(args, steps, k, i);
 
-    double sun[3];
-    for(int i=0; i<3; i++)
-	sun[i] = -phn[i]-pv[i];
+        if(!site_ok(x[1], x[2]) || !star_ok(x[4], x[5])){
+            uf_nan(args, steps, 11, 18, i);
+            continue;
+        }
 
-    double ra, dec, az, el;
-    slaDcc2s(sun, &ra, &dec);
-    slaDe2h(last-ra, dec, latr, &az, &el);
-    double refract=0.;
+        if(x[1] != lon || x[2] != lat || x[3] != height){
+            lon    = x[1];
+            lat    = x[2];
+            height = x[3];
+            make_site(lon, lat, height, site);
+        }
 
-    if(fast){
-	double refa, refb, zobs;
-	slaRefcoq(T, P, rh, wave, &refa, &refb);
-	slaRefz(Constants::PI/2.-el, refa, refb, &zobs);
-	refract = Constants::PI/2.-el - zobs;
-    }else{
-	for(int i=0; i<5; i++){
-	    double zd = Constants::PI/2.-el-refract;
-	    slaRefro(zd, height, T, P, rh, wave, latr, TLR, 1.e-8, &refract);
-	}
+        Star star;
+        make_star(x[4], x[5], x[6], x[7], x[8], x[9], x[10], star);
+        utc2tdb_point(x[0], site, star, NULL, res);
+        uf_out(args, steps, 11, i) = res.tt;
+        uf_out(args, steps, 12, i) = res.tdb;
+        uf_out(args, steps, 13, i) = res.btdb;
+        uf_out(args, steps, 14, i) = res.hutc;
+        uf_out(args, steps, 15, i) = res.htdb;
+        uf_out(args, steps, 16, i) = res.vhel;
+        uf_out(args, steps, 17, i) = res.vbar;
     }
+}
 
-    // return  azimuth and elevation
-    return Py_BuildValue("ddddd", az/CFAC, (el+refract)/CFAC, refract/CFAC, 
-			 12.*ra/Constants::PI, dec/CFAC);
+// utc, longitude, latitude, height, ra, dec, wave, pmra, pmdec, epoch,
+// parallax, rv -> airmass, alt, az, ha, pa, delz
 
-};
+static void
+amass_loop(char **args, npy_intp const *dimensions, npy_intp const *steps, void *data)
+{
+    Site site;
+    Atmosphere atmos;
+    Apparent app(site, atmos, NULL);
+    double lon = NAN, lat = NAN, height = NAN, wave = NAN;
+    Amass_result res;
+    for(npy_intp i=0; i<dimensions[0]; i++){
+        double x[12];
+        for(int k=0; k<12; k++) x[k] = uf_in(args, steps, k, i);
 
-// Convert FK4 B1950 to Fk5 J2000 coords
+        if(!site_ok(x[1], x[2]) || !star_ok(x[4], x[5]) || !atmos_ok(x[6], 0.2)){
+            uf_nan(args, steps, 12, 18, i);
+            continue;
+        }
 
-static PyObject* 
-sla_fk425(PyObject *self, PyObject *args)
+        if(x[1] != lon || x[2] != lat || x[3] != height || x[6] != wave){
+            lon    = x[1];
+            lat    = x[2];
+            height = x[3];
+            wave   = x[6];
+            make_site(lon, lat, height, site);
+            make_atmos(wave, 0.2, atmos);
+            app.reset();
+        }
+
+        Star star;
+        make_star(x[4], x[5], x[7], x[8], x[9], x[10], x[11], star);
+        amass_point(x[0], site, star, atmos, app, res);
+        uf_out(args, steps, 12, i) = res.airmass;
+        uf_out(args, steps, 13, i) = res.alt;
+        uf_out(args, steps, 14, i) = res.az;
+        uf_out(args, steps, 15, i) = res.ha;
+        uf_out(args, steps, 16, i) = res.pa;
+        uf_out(args, steps, 17, i) = res.delz;
+    }
+}
+
+// utc, longitude, latitude, height, wave, rh, fast (bool)
+// -> azimuth, elevation, refract, ra, dec
+
+static void
+sun_loop(char **args, npy_intp const *dimensions, npy_intp const *steps, void *data)
 {
+    Site site;
+    Atmosphere atmos;
+    double lon = NAN, lat = NAN, height = NAN, wave = NAN, rh = NAN;
+    Sun_result res;
+    for(npy_intp i=0; i<dimensions[0]; i++){
+        double x[6];
+        for(int k=0; k<6; k++) x[k] = uf_in(args, steps, k, i);
+        bool fast = *(const npy_bool *)(args[6] + i*steps[6]) != 0;
 
-    double ra4, dec4, pmra4 = 0., pmdec4 = 0., parallax4 = 0., rv4 = 0.; 
-    if(!PyArg_ParseTuple(args, "dd|dddd:sla.precess", &ra4, &dec4, &pmra4, 
-			 &pmdec4, &parallax4, &rv4))
-	return NULL;
+        if(!site_ok(x[1], x[2]) || !atmos_ok(x[4], x[5])){
+            uf_nan(args, steps, 7, 12, i);
+            continue;
+        }
 
-    // Some checks on the inputs
-    if(ra4 < 0. || ra4 > 24.){
-	PyErr_SetString(PyExc_ValueError, "sla.fk425: ra out of range 0 to 24");
-	return NULL;
+        if(x[1] != lon || x[2] != lat || x[3] != height){
+            lon    = x[1];
+            lat    = x[2];
+            height = x[3];
+            make_site(lon, lat, height, site);
+        }
+        if(x[4] != wave || x[5] != rh){
+            wave = x[4];
+            rh   = x[5];
+            make_atmos(wave, rh, atmos);
+        }
+
+        sun_point(x[0], site, atmos, fast, NULL, NULL, res);
+        uf_out(args, steps,  7, i) = res.az;
+        uf_out(args, steps,  8, i) = res.el;
+        uf_out(args, steps,  9, i) = res.refract;
+        uf_out(args, steps, 10, i) = res.ra;
+        uf_out(args, steps, 11, i) = res.dec;
     }
+}
 
-    if(dec4 < -90. || dec4 > +90.){
-	PyErr_SetString(PyExc_ValueError, "sla.fk425: declination out of range -90 to +90");
-	return NULL;
+// ra, dec -> gl, gb
+
+static void
+eqgal_loop(char **args, npy_intp const *dimensions, npy_intp const *steps, void *data)
+{
+    const double CFAC = Constants::PI/180.;
+    for(npy_intp i=0; i<dimensions[0]; i++){
+        double glong, glat;
+        slaEqgal(CFAC*15.*uf_in(args, steps, 0, i), CFAC*uf_in(args, steps, 1, i), &glong, &glat);
+        uf_out(args, steps, 2, i) = glong/CFAC;
+        uf_out(args, steps, 3, i) = glat/CFAC;
     }
+}
 
-    // convert angles to those expected by sla routines
+// gl, gb -> ra, dec
+
+static void
+galeq_loop(char **args, npy_intp const *dimensions, npy_intp const *steps, void *data)
+{
     const double CFAC = Constants::PI/180.;
-    double rar4    = CFAC*15.*ra4;
-    double decr4   = CFAC*dec4;
-    double pmrar4  = CFAC*pmra4/3600.;
-    double pmdecr4 = CFAC*pmdec4/3600.;
-    
-    double rar5, decr5, pmrar5, pmdecr5, parallax5, rv5;
-    slaFk425(rar4, decr4, pmrar4, pmdecr4, parallax4, rv4, 
-	     &rar5, &decr5, &pmrar5, &pmdecr5, &parallax5, &rv5);
+    for(npy_intp i=0; i<dimensions[0]; i++){
+        double ra, dec;
+        slaGaleq(CFAC*uf_in(args, steps, 0, i), CFAC*uf_in(args, steps, 1, i), &ra, &dec);
+        uf_out(args, steps, 2, i) = ra/(15.*CFAC);
+        uf_out(args, steps, 3, i) = dec/CFAC;
+    }
+}
 
-    double ra5    = rar5/CFAC/15.;
-    double dec5   = decr5/CFAC;
-    double pmra5  = 3600.*pmrar5/CFAC;
-    double pmdec5 = 3600.*pmdecr5/CFAC;
+// Loop functions, data and signatures. NumPy keeps pointers to these, so
+// they must be static.
 
-    return Py_BuildValue("dddddd", ra5, dec5, pmra5, pmdec5, parallax5, rv5);
+static PyUFuncGenericFunction utc2tdb_funcs[] = {utc2tdb_loop};
+static PyUFuncGenericFunction amass_funcs[]   = {amass_loop};
+static PyUFuncGenericFunction sun_funcs[]     = {sun_loop};
+static PyUFuncGenericFunction eqgal_funcs[]   = {eqgal_loop};
+static PyUFuncGenericFunction galeq_funcs[]   = {galeq_loop};
+static void *ufunc_data[] = {NULL};
+static char utc2tdb_types[18], amass_types[18], sun_types[12], coord_types[4];
 
-};
+static std::once_flag ufunc_types_once;
+
+// Creates the ufuncs and adds them to module m. The ufuncs share the
+// static loops and signatures, filled in once for all module objects, but
+// not the caches of any module, which they might outlive.
+
+static int
+add_ufuncs(PyObject *m)
+{
+    std::call_once(ufunc_types_once, [](){
+            std::memset(utc2tdb_types, NPY_DOUBLE, sizeof(utc2tdb_types));
+            std::memset(amass_types, NPY_DOUBLE, sizeof(amass_types));
+            std::memset(sun_types, NPY_DOUBLE, sizeof(sun_types));
+            sun_types[6] = NPY_BOOL;
+            std::memset(coord_types, NPY_DOUBLE, sizeof(coord_types));
+        });
+
+    PyObject *uf;
+
+    uf = PyUFunc_FromFuncAndData(utc2tdb_funcs, ufunc_data, utc2tdb_types, 1, 11, 7, PyUFunc_None,
+                                 (char*)"ufunc_utc2tdb",
+        (char*)"tt,tdb,btdb,hutc,htdb,vhel,vbar =\n"
+        "    ufunc_utc2tdb(utc,longitude,latitude,height,ra,dec,pmra,pmdec,epoch,parallax,rv)\n\n"
+        "NumPy ufunc version of utc2tdb. All arguments must be given and broadcast against\n"
+        "each other, e.g. a column of utcs and a row of targets give 2D outputs. Invalid\n"
+        "inputs give NaN outputs.", 0);
+    if(uf == NULL || PyModule_AddObject(m, "ufunc_utc2tdb", uf) < 0) return -1;
+
+    uf = PyUFunc_FromFuncAndData(amass_funcs, ufunc_data, amass_types, 1, 12, 6, PyUFunc_None,
+                                 (char*)"ufunc_amass",
+        (char*)"airmass,alt,az,ha,pa,delz =\n"
+        "    ufunc_amass(utc,longitude,latitude,height,ra,dec,wave,pmra,pmdec,epoch,parallax,rv)\n\n"
+        "NumPy ufunc version of amass. All arguments must be given and broadcast against\n"
+        "each other. Invalid inputs give NaN outputs. As for amass, the target-independent\n"
+        "parameters are re-used over an hour of utc, so results can depend on element order\n"
+        "at the 0.02 arcsec level.", 0);
+    if(uf == NULL || PyModule_AddObject(m, "ufunc_amass", uf) < 0) return -1;
+
+    uf = PyUFunc_FromFuncAndData(sun_funcs, ufunc_data, sun_types, 1, 7, 5, PyUFunc_None,
+                                 (char*)"ufunc_sun",
+        (char*)"azimuth,elevation,refract,ra,dec = ufunc_sun(utc,longitude,latitude,height,wave,rh,fast)\n\n"
+        "NumPy ufunc version of sun. All arguments must be given and broadcast against each\n"
+        "other; fast is boolean. Invalid inputs give NaN outputs.", 0);
+    if(uf == NULL || PyModule_AddObject(m, "ufunc_sun", uf) < 0) return -1;
+
+    uf = PyUFunc_FromFuncAndData(eqgal_funcs, ufunc_data, coord_types, 1, 2, 2, PyUFunc_None,
+                                 (char*)"ufunc_eqgal",
+        (char*)"gl,gb = ufunc_eqgal(ra,dec)\n\n"
+        "NumPy ufunc version of eqgal.", 0);
+    if(uf == NULL || PyModule_AddObject(m, "ufunc_eqgal", uf) < 0) return -1;
+
+    uf = PyUFunc_FromFuncAndData(galeq_funcs, ufunc_data, coord_types, 1, 2, 2, PyUFunc_None,
+                                 (char*)"ufunc_galeq",
+        (char*)"ra,dec = ufunc_galeq(gl,gb)\n\n"
+        "NumPy ufunc version of galeq.", 0);
+    if(uf == NULL || PyModule_AddObject(m, "ufunc_galeq", uf) < 0) return -1;
+
+    return 0;
+}
 
 //----------------------------------------------------------------------------------------
 // The methods
@@ -752,28 +4434,37 @@ sla_fk425(PyObject *self, PyObject *args)
 static PyMethodDef SlaMethods[] = {
 
     {"dtt", sla_dtt, METH_VARARGS, 
-     "d = dtt(utc) returns TT-UTC in seconds. UTC in MJD = JD-2400000.5."},
+     "d = dtt(utc) returns TT-UTC in seconds. UTC in MJD = JD-2400000.5. utc can be a float or a 1D\n"
+     "array; arrays are handled with a table of leap seconds rather than a call to slaDtt per element."},
 
     {"cldj", sla_cldj, METH_VARARGS, 
-     "mjd = cldj(year, month, day) returns the mjd of the Gregorian calendar date; MJD = JD-2400000.5."},
+     "mjd = cldj(year, month, day) returns the mjd of the Gregorian calendar date; MJD = JD-2400000.5.\n"
+     "year, month and day can be integers or 1D arrays of the same length, giving an array of mjds."},
 
     {"djcl", sla_djcl, METH_VARARGS, 
-     "year,month,day,hour = djcl(mjd) decomposes an mjd into more usual times."},
+     "year,month,day,hour = djcl(mjd) decomposes an mjd into more usual times. If mjd is a 1D array,\n"
+     "the outputs are arrays, integer apart from hour."},
 
-    {"eqgal", sla_eqgal, METH_VARARGS, 
-     "glong,glat = eqgal(ra,dec) returns galactic coords (degress) given ra, dec (J2000) in hours and degrees."},
+    {"eqgal", (PyCFunction)sla_eqgal, METH_VARARGS | METH_KEYWORDS, 
+     "glong,glat = eqgal(ra,dec,nthreads=1) returns galactic coords (degress) given ra, dec (J2000) in hours\n"
+     "and degrees. ra and dec can be floats or 1D arrays of the same length, in which case the outputs are\n"
+     "arrays. nthreads is the number of threads used for arrays (<1 for one per core)."},
 
-    {"fk425", sla_fk425, METH_VARARGS, 
-     "ra,dec,pmra,pmdec,parallax,rv = fk425(ra,dec,pmra=0,pmdec=0,parallax=0,rv=0) converts FK4 B1950 to FK5 J2000\n."
-     "ra and dec are in hours and degrees; proper motions are in arcsec/year (not seconds of RA);\n"
-     "parallax is in arcsec and the radial velocity is in km/s.\n"},
+    {"fk425", (PyCFunction)sla_fk425, METH_VARARGS | METH_KEYWORDS, 
+     "ra,dec,pmra,pmdec,parallax,rv = fk425(ra,dec,pmra=0,pmdec=0,parallax=0,rv=0,nthreads=1) converts FK4\n"
+     "B1950 to FK5 J2000. ra and dec are in hours and degrees; proper motions are in arcsec/year (not seconds\n"
+     "of RA); parallax is in arcsec and the radial velocity is in km/s. Any of the first six arguments can be\n"
+     "1D arrays, all of the same length, in which case the outputs are arrays; e.g. a whole catalogue can be\n"
+     "converted at once. nthreads is the number of threads used for arrays (<1 for one per core).\n"},
 
-    {"galeq", sla_galeq, METH_VARARGS, 
-     "ra,dec = galeq(glong,glat) returns FK5 J2000 coords (hours,degrees) given galactic coords (degrees)."},
+    {"galeq", (PyCFunction)sla_galeq, METH_VARARGS | METH_KEYWORDS, 
+     "ra,dec = galeq(glong,glat,nthreads=1) returns FK5 J2000 coords (hours,degrees) given galactic coords\n"
+     "(degrees). As for eqgal, glong and glat can be 1D arrays."},
 
-    {"utc2tdb", sla_utc2tdb, METH_VARARGS, 
+    {"utc2tdb", (PyCFunction)sla_utc2tdb, METH_VARARGS | METH_KEYWORDS, 
      "tt,tdb,btdb,hutc,htdb,vhel,vbar =\n"
-     "    utc2tdb(utc,longitude,latitude,height,ra,dec,pmra=0,pmdec=0,epoch=2000,parallax=0,rv=0).\n\n"
+     "    utc2tdb(utc,longitude,latitude,height,ra,dec,pmra=0,pmdec=0,epoch=2000,parallax=0,rv=0,\n"
+     "            nthreads=1,mode='exact',outputs=None,dtype=None,out=None).\n\n"
      "All times are in MJD. Longitude and latitude are in degrees, east positive; ra and dec are in\n"
      "hours and degrees; proper motions are in arcsec/year (not seconds of RA); parallax is in arcsec\n"
      "and the radial velocity is in km/s. tt is terrestrial time (once ephemeris time); tdb is\n"
@@ -782,34 +4473,286 @@ static PyMethodDef SlaMethods[] = {
      "travel to the heliocentre (usual form); htdb is the TDB corrected for light travel to the\n"
      "heliocentre (unusual). vhel and vbar are the apparent radial velocity of the target in km/s\n"
      "owing to observer's motion in relative to the helio- and barycentres. If utc is a float then\n"
-     "so too will the output. If it is an array, then so will the outputs be."},
+     "so too will the output. If it is an array, then so will the outputs be. float64 and float32 arrays\n"
+     "of either byte order are read in place, so strided slices and big-endian FITS columns are not\n"
+     "copied; other numeric types are converted. This applies to all functions taking utc arrays.\n"
+     "nthreads is the number of threads used to process an array of utcs (<1 for one per core); the\n"
+     "results do not depend upon it. mode='interp' speeds up arrays of utcs by interpolating the Earth's\n"
+     "position and velocity, the precession-nutation matrix and TDB-TT from a table computed every 0.5\n"
+     "days over the range of utc. This adds errors of less than 0.1 microseconds to the light travel\n"
+     "times, well under 1 ns to TDB-TT, and 1 mm/s to the velocities. Repeated utcs in an array are\n"
+     "computed once if adjacent, so time-sorted event lists with many equal times are cheap. Single\n"
+     "utcs always use mode='exact'. outputs can be a name or a sequence of names from\n"
+     "'tt', 'tdb', 'btdb', 'hutc', 'htdb', 'vhel' and 'vbar' to compute and return only those, in the\n"
+     "order given, e.g. outputs='btdb' returns a 1-element tuple. out can be a sequence of preallocated\n"
+     "arrays, one per output (or a 2D array with a row for each), to write array results into, as for\n"
+     "amass. dtype=numpy.float32 returns vhel and vbar as float32 arrays to save memory; the times are\n"
+     "always float64."},
+
+    {"utc2tdb_batch", (PyCFunction)sla_utc2tdb_batch, METH_VARARGS | METH_KEYWORDS, 
+     "tt,tdb,btdb,hutc,htdb,vhel,vbar =\n"
+     "    utc2tdb_batch(utc,longitude,latitude,height,ra,dec,pmra=0,pmdec=0,epoch=2000,parallax=0,rv=0,\n"
+     "                  nthreads=1,mode='exact',outputs=None,dtype=None,out=None).\n\n"
+     "As utc2tdb but for many targets at once, e.g. all the stars in a set of frames. ra, dec, pmra,\n"
+     "pmdec, epoch, parallax and rv can each be a float or a 1D array with one value per target; all\n"
+     "arrays must have the same length. utc is an MJD or an array of MJDs. tt and tdb, which do not\n"
+     "depend upon the target, are returned as 1D arrays of length ntime; btdb, hutc, htdb, vhel and\n"
+     "vbar are 2D arrays of shape (ntarget,ntime). The position and velocity of the observatory are\n"
+     "computed once per utc and shared by all targets. nthreads, mode, outputs, dtype and out are as\n"
+     "for utc2tdb; the arrays in out must have the same shapes as the outputs."},
 
-    {"amass", sla_amass, METH_VARARGS, 
+    {"amass", (PyCFunction)sla_amass, METH_VARARGS | METH_KEYWORDS, 
      "airmass, alt, az, ha, pa, delz =\n"
-     "  amass(utc,longitude,latitude,height,ra,dec,wave=0.55,pmra=0,pmdec=0,epoch=2000,parallax=0,rv=0).\n\n"
+     "  amass(utc,longitude,latitude,height,ra,dec,wave=0.55,pmra=0,pmdec=0,epoch=2000,parallax=0,rv=0,\n"
+     "        temp=285,pressure=1013.25,rh=0.2,tlr=0.0065,dut=0,xp=0,yp=0,outputs=None,dtype=None,\n"
+     "        out=None).\n\n"
      "utc is an MJD or an array of MJDs. Longitude and latitude are in degrees, east positive; ra and dec are in\n"
      "hours and degrees; the wavelength of observation wave is in microns; proper motions are in\n"
-     "arcsec/year (not seconds of RA); parallax is in arcsec and the radial velocity is in km/s.\n\n"
+     "arcsec/year (not seconds of RA); parallax is in arcsec and the radial velocity is in km/s.\n"
+     "temp (K), pressure (mbar), rh (0 to 1) and tlr (the lapse rate, K/metre) describe the weather\n"
+     "for the refraction; dut is UT1-UTC in seconds and xp and yp are the polar motion in arcsec, as\n"
+     "given by the IERS. The slaRefco refraction constants are cached for the last few combinations of\n"
+     "site, weather and Earth orientation, so repeated calls with the same values avoid recomputing\n"
+     "them.\n\n"
      "airmass is the airmass; alt and az are the observed altitude and azimuth in degrees with azimuth\n"
      "measured North through East; ha is the observed hour angle in hours; pa is the position angle\n"
-     "of a parallactic slit; delz is the angle of refraction in degrees."},
+     "of a parallactic slit; delz is the angle of refraction in degrees. For arrays, the star-independent\n"
+     "parts of the calculation are re-used for up to an hour of utc, so time-ordered arrays are fastest.\n"
+     "outputs can be a name or a sequence of names from 'airmass', 'alt', 'az', 'ha', 'pa' and 'delz'\n"
+     "to compute and return only those, in the order given; the airmass, pa and delz calculations are\n"
+     "skipped if not needed. out can be a sequence of preallocated arrays, one per output (or a 2D\n"
+     "array with a row for each), to write array results into rather than allocating new ones; they\n"
+     "must be writeable, C-contiguous arrays of the output type and the same length as utc. They are\n"
+     "also returned. dtype=numpy.float32 gives float32 array outputs, which is ample precision for all\n"
+     "of them and halves the memory used."},
+
+    {"amass_batch", (PyCFunction)sla_amass_batch, METH_VARARGS | METH_KEYWORDS, 
+     "airmass, alt, az, ha, pa, delz =\n"
+     "  amass_batch(utc,longitude,latitude,height,ra,dec,wave=0.55,pmra=0,pmdec=0,epoch=2000,parallax=0,\n"
+     "              rv=0,temp=285,pressure=1013.25,rh=0.2,tlr=0.0065,dut=0,xp=0,yp=0,nthreads=1,\n"
+     "              outputs=None,dtype=None,out=None).\n\n"
+     "As amass but for many targets at once. ra, dec, pmra, pmdec, epoch, parallax and rv can each be\n"
+     "a float or a 1D array with one value per target; all arrays must have the same length. utc is an\n"
+     "MJD or an array of MJDs. The outputs are 2D arrays of shape (ntarget,ntime). The parts of the\n"
+     "calculation that do not depend on the target are computed once per utc. nthreads is the number\n"
+     "of threads to use (<1 for one per core). outputs, dtype and out are as for amass but the\n"
+     "arrays must be 2D."},
 
-    {"sun", sla_sun, METH_VARARGS, 
-     "azimuth,elevation,refract,ra,dec = sun(utc,longitude,latitude,height,wave=0.55,rh=0.2,fast=True).\n\n"
-     "All times are in MJD. Longitude and latitude are in degrees, east positive;\n"
+    {"sun", (PyCFunction)sla_sun, METH_VARARGS | METH_KEYWORDS, 
+     "azimuth,elevation,refract,ra,dec =\n"
+     "    sun(utc,longitude,latitude,height,wave=0.55,rh=0.2,fast=True,nthreads=1,mode='exact',rtable=False,\n"
+     "        out=None).\n\n"
+     "utc is an MJD or an array of MJDs. Longitude and latitude are in degrees, east positive;\n"
      "the wavelength of observation wave is in microns; rh is the relative humidity.\n\n"
      "azimuth is measured in degrees, North through East, elevation in degrees above the horizon.\n"
      "refract is the angle of refraction in degrees. ra and dec are the position of the Sun for\n"
      "the mean equator and equinox of the utc supplied, FK5. fast determines whether a fast or slow\n"
      "is used. The fast method is OK for >15 degrees above the horizon, but for accurate values\n"
-     "below this you may want the slow method\n"},
+     "below this you may want the slow method, which iterates slaRefro to convergence. rtable=True\n"
+     "speeds up the slow method by interpolating slaRefro from a table built once per site and\n"
+     "atmosphere (see refro_table for its accuracy). If utc is an array, so will the outputs be, and\n"
+     "nthreads sets the number of threads used to compute them (<1 for one per core). mode='interp'\n"
+     "interpolates the Earth's position, precession-nutation and equation of the equinoxes from a\n"
+     "table as for utc2tdb, leaving only the observatory position, the conversion to azimuth and\n"
+     "elevation, and refraction per utc; the positions agree with mode='exact' to well under an\n"
+     "arcsecond. out can be a sequence of 5 preallocated arrays to write array results into, as\n"
+     "for amass.\n"},
+
+    {"night_table", (PyCFunction)sla_night_table, METH_VARARGS | METH_KEYWORDS, 
+     "nights, events = night_table(site,mjd,ndays,targets,alt=30,twilight=-18,horizon=-0.25,acc=1.e-5,\n"
+     "                             nthreads=1)\n\n"
+     "Computes the Sun and target events of ndays nights at the Observatory site, starting with the\n"
+     "night beginning on the evening of integer MJD mjd; targets is a sequence of Targets. nights is\n"
+     "a structured array of length ndays with fields mjd (the MJD of the evening), midnight (local mean\n"
+     "midnight), sunset, dusk, dawn and sunrise, where sunset and sunrise are when the Sun is at\n"
+     "elevation horizon and dusk and dawn when it is at twilight (degrees). events is a structured array\n"
+     "of shape (ndays,len(targets)) with fields rise, transit, set, alt_transit and alt_max: transit is\n"
+     "the meridian crossing nearest midnight, rise and set are when the target is at altitude alt\n"
+     "either side of it, alt_transit is the altitude at transit and alt_max the highest altitude\n"
+     "between dusk and dawn. All times are MJD (UTC), found to acc days using the slow refraction\n"
+     "method for the Sun, and altitudes are observed ones in degrees, as for amass. Events that do\n"
+     "not occur, e.g. rise and set of a target that never reaches alt, are NaN. The calculation is\n"
+     "split over nthreads threads (<1 for one per core).\n"},
+
+    {"run_batch", (PyCFunction)sla_run_batch, METH_VARARGS | METH_KEYWORDS, 
+     "results = run_batch(jobs,nthreads=1)\n\n"
+     "Carries out many independent scalar calls of utc2tdb, amass and sun at once. jobs is a sequence\n"
+     "of (name,args) pairs where name is 'utc2tdb', 'amass' or 'sun' and args is a tuple of the\n"
+     "positional arguments of the module function of that name with a single utc, e.g.\n"
+     "('sun',(utc,longitude,latitude,height)). The jobs are grouped by kind, site and atmosphere and\n"
+     "sorted by utc so that they share set-up work as far as arrays would, then computed in nthreads\n"
+     "threads (<1 for one per core) without the GIL. results has one element per job, in the order\n"
+     "of jobs: the tuple of floats the function would return or, if that job's arguments were\n"
+     "invalid, the exception it would raise. See Batcher for a way to collect jobs from many\n"
+     "threads."},
+
+    {"visibility_windows", (PyCFunction)sla_visibility_windows, METH_VARARGS | METH_KEYWORDS, 
+     "windows = visibility_windows(site,utc1,utc2,targets,airmass=2,sun_alt=-12,acc=1.e-5,nthreads=1)\n\n"
+     "Finds the periods between MJDs utc1 and utc2 when each of a sequence of Targets is observable\n"
+     "from the Observatory site, i.e. when its airmass is below airmass and the Sun is below elevation\n"
+     "sun_alt (degrees). windows is a list with one element per target, a float64 array of shape (n,2)\n"
+     "of the start and end MJD (UTC) of each of its n periods, in time order. Periods of continuous\n"
+     "darkness (polar night) are merged across nights. Rather than sampling, the altitude limit\n"
+     "equivalent to airmass is found once; the times it is crossed are estimated from the hour angle\n"
+     "limits given by the target's declination, then refined to acc days by root-finding, as are the\n"
+     "Sun's crossings of sun_alt, using the slow refraction method. The Sun's lowest point is taken\n"
+     "to be at local mean midnight. The targets are split over nthreads threads (<1 for one per\n"
+     "core).\n"},
+
+    {"sun_root", (PyCFunction)sla_sun_root, METH_VARARGS | METH_KEYWORDS, 
+     "utc = sun_root(utc1,utc2,elev,longitude,latitude,height,wave=0.55,rh=0.2,acc=1.e-5,fast=True,nthreads=1,\n"
+     "               mode='exact',rtable=False)\n\n"
+     "Finds the MJD at which the Sun is at elevation elev (degrees) between utc1 and utc2 to an accuracy\n"
+     "of acc days, using the Illinois method. utc1, utc2, elev, longitude, latitude and height can be\n"
+     "floats or 1D arrays of the same length, giving an array of results computed in nthreads threads\n"
+     "(<1 for one per core); e.g. sunsets and twilights for many nights and sites in one call. Results\n"
+     "are NaN where the times do not bracket the elevation. The other arguments are as for sun;\n"
+     "mode='interp' applies to arrays only.\n"},
+
+    {"refro_table", (PyCFunction)sla_refro_table, METH_VARARGS | METH_KEYWORDS, 
+     "zd, refract, maxerr = refro_table(latitude,height,wave=0.55,rh=0.2,nthreads=1)\n\n"
+     "Returns the table of slaRefro used by sun and sun_root with fast=False and rtable=True for\n"
+     "a site at the given latitude (degrees) and height (metres): observed zenith distances and\n"
+     "refraction angles in degrees, and the largest interpolation error found at the midpoints of\n"
+     "the table in arcsec. The table is built in nthreads threads and kept for re-use.\n"},
+
+    {"stats", sla_stats, METH_NOARGS, 
+     "stats = stats()\n\n"
+     "Returns a dictionary of (ncall, seconds) for the stages of utc2tdb, amass and sun, keyed by\n"
+     "name, accumulated since the module was loaded or reset_stats was last called. 'utc2tdb',\n"
+     "'amass' and 'sun' are the whole calls (of the batch forms too) including the conversion of\n"
+     "inputs and outputs; the others ('slaDtt', 'slaRcc', 'ephemeris' (slaEpv/slaEvp), 'nutation',\n"
+     "'earth_table' (mode='interp'), 'observer' (slaGmst, slaPvobs), 'target', 'slaMappa',\n"
+     "'slaAoppa', 'apparent' (slaMapqkz, slaAopqk etc) and 'refraction') are parts of these, summed\n"
+     "over threads. Stages not yet called are left out. Profiling costs time, so the counters are\n"
+     "only compiled in when the extension is built with the environment variable TRM_SLA_PROFILE\n"
+     "set; otherwise the dictionary is always empty."},
+
+    {"reset_stats", sla_reset_stats, METH_NOARGS, 
+     "reset_stats()\n\n"
+     "Zeroes the counters returned by stats."},
+
+    {"build_cache", (PyCFunction)sla_build_cache, METH_VARARGS | METH_KEYWORDS, 
+     "build_cache(fname,mjd1,mjd2,nthreads=1)\n\n"
+     "Writes the table of the Earth's position and velocity, precession-nutation and TDB-TT used by\n"
+     "mode='interp' for utcs from mjd1 to mjd2 to the binary file fname, computing it in nthreads\n"
+     "threads. The table does not depend upon the site. Once loaded with load_cache, or by setting\n"
+     "the environment variable TRM_SLA_CACHE to fname before importing sla, calls with mode='interp'\n"
+     "whose utcs lie in the range use the file rather than computing a table. The file is mapped\n"
+     "into memory rather than read, so that it loads instantly and is shared between processes. It\n"
+     "takes about 150 kbytes per year and is specific to the machine's byte order."},
+
+    {"load_cache", (PyCFunction)sla_load_cache, METH_VARARGS | METH_KEYWORDS, 
+     "mjd1, mjd2 = load_cache(fname)\n\n"
+     "Maps the table file fname written by build_cache for use by mode='interp' in place of any loaded\n"
+     "before, returning the range of utc it covers. IOError is raised if the file is missing or\n"
+     "invalid, e.g. if written by a different version of sla."},
 
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
+//----------------------------------------------------------------------------------------
+// The module. It uses multi-phase initialisation: everything it holds, the
+// caches and the types, is in the state of each module object rather than
+// static, so that it can be loaded into sub-interpreters and re-imported.
+// Those must share the main GIL, as NumPy does not support sub-interpreters
+// with their own. All the C++ code is thread-safe, and the Observatory and
+// Target objects are only read and written within critical sections, so it
+// also declares that it does not need the GIL in the free-threaded build.
+
+static int
+sla_exec(PyObject *m)
+{
+    if(_import_array() < 0 || _import_umath() < 0) return -1;
+
+    Module_state *state = module_state(m);
+    state->caches = new Caches;
+
+    if(add_types(m, state) < 0 || add_ufuncs(m) < 0) return -1;
+
+    // a bad cache file is not fatal as tables can always be computed
+    const char *cache = getenv("TRM_SLA_CACHE");
+    std::string error;
+    if(cache != NULL && *cache && !load_table_file(state->caches->file, cache, error) &&
+       PyErr_WarnEx(PyExc_RuntimeWarning, ("sla: TRM_SLA_CACHE ignored: " + error).c_str(), 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+sla_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    Module_state *state = module_state(m);
+    Py_VISIT(state->target_type);
+    Py_VISIT(state->observatory_type);
+    return 0;
+}
+
+static int
+sla_clear(PyObject *m)
+{
+    Module_state *state = module_state(m);
+    Py_CLEAR(state->target_type);
+    Py_CLEAR(state->observatory_type);
+    return 0;
+}
+
+static void
+sla_free(void *m)
+{
+    sla_clear((PyObject*)m);
+    Module_state *state = module_state((PyObject*)m);
+    delete state->caches;
+    state->caches = NULL;
+}
+
+static PyModuleDef_Slot sla_slots[] = {
+    {Py_mod_exec, (void*)sla_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static PyModuleDef sla_module = {
+    PyModuleDef_HEAD_INIT,
+    "_sla",
+    "C++ interface to slalib, used by trm.sla",
+    sizeof(Module_state),
+    SlaMethods,
+    sla_slots,
+    sla_traverse,
+    sla_clear,
+    sla_free
+};
+
+static Module_state*
+type_state(PyTypeObject *type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject *m = PyType_GetModuleByDef(type, &sla_module);
+    return m ? module_state(m) : NULL;
+#else
+    // search the bases for the type defined here, as PyType_GetModuleByDef
+    PyObject *mro = type->tp_mro;
+    for(Py_ssize_t i=0; mro && i<PyTuple_GET_SIZE(mro); i++){
+        PyTypeObject *base = (PyTypeObject*) PyTuple_GET_ITEM(mro, i);
+        if(!(base->tp_flags & Py_TPFLAGS_HEAPTYPE)) continue;
+        PyObject *m = PyType_GetModule(base);
+        if(m && PyModule_GetDef(m) == &sla_module) return module_state(m);
+        PyErr_Clear();
+    }
+    PyErr_SetString(PyExc_TypeError, "sla: type not defined by the sla module");
+    return NULL;
+#endif
+}
+
 PyMODINIT_FUNC
-init_sla(void)
+PyInit__sla(void)
 {
-    (void) Py_InitModule("_sla", SlaMethods);
-    import_array();
+    return PyModuleDef_Init(&sla_module);
 }